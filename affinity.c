@@ -0,0 +1,172 @@
+#if defined __linux__
+// for CPU_SET() and the *_np affinity calls
+#define _GNU_SOURCE
+#endif
+
+#include "affinity.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+struct cpu_info {
+  int cpu;
+  int package;
+  int core;
+  // position of the core within its package
+  int core_rank;
+  // position of the cpu among the SMT siblings of its core
+  int smt_rank;
+};
+
+int cpu_list_parse(const char *list, int *cpus, int max) {
+  int n = 0;
+  char *end;
+
+  while (*list && *list != '\n') {
+    long first = strtol(list, &end, 10);
+    if (end == list || first < 0) return -1;
+    long last = first;
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list || last < first) return -1;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      if (n == max) return -1;
+      cpus[n++] = (int)cpu;
+    }
+
+    if (*end == ',')
+      ++end;
+    else if (*end && *end != '\n')
+      return -1;
+    list = end;
+  }
+
+  return n;
+}
+
+// reads a small integer out of a sysfs file, -1 if there is none
+static int read_sysfs_int(int cpu, const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/%s", cpu, name);
+
+  FILE *f = fopen(path, "r");
+  if (!f) return -1;
+  int value;
+  if (fscanf(f, "%d", &value) != 1) value = -1;
+  fclose(f);
+
+  return value;
+}
+
+static enum placement sort_placement;
+
+// the sort key of a cpu, most significant first
+static void placement_key(const struct cpu_info *c, int key[4]) {
+  if (sort_placement == PLACEMENT_SPREAD) {
+    key[0] = c->smt_rank;
+    key[1] = c->core_rank;
+    key[2] = c->package;
+  } else {
+    key[0] = c->package;
+    key[1] = c->smt_rank;
+    key[2] = c->core_rank;
+  }
+  key[3] = c->cpu;
+}
+
+static int compare_cpus(const void *a, const void *b) {
+  int x[4], y[4];
+  placement_key(a, x);
+  placement_key(b, y);
+
+  for (int i = 0; i < 4; ++i)
+    if (x[i] != y[i]) return x[i] < y[i] ? -1 : 1;
+  return 0;
+}
+
+int cpu_placement(enum placement placement, int *cpus, int max) {
+#if defined __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return -1;
+
+  struct cpu_info *info = calloc(CPU_SETSIZE, sizeof(*info));
+  if (!info) return -1;
+
+  int n = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed)) continue;
+    info[n].cpu = cpu;
+    // containers may hide the topology, then every cpu is a core of its own
+    info[n].package = read_sysfs_int(cpu, "physical_package_id");
+    info[n].core = read_sysfs_int(cpu, "core_id");
+    if (info[n].core < 0) info[n].core = cpu;
+    ++n;
+  }
+
+  // ranks from the ids, the cpus are in ascending order
+  for (int i = 0; i < n; ++i)
+    for (int j = 0; j < i; ++j)
+      if (info[j].package == info[i].package && info[j].core == info[i].core)
+        info[i].smt_rank++;
+  // counting the first sibling of every core only
+  for (int i = 0; i < n; ++i)
+    for (int j = 0; j < n; ++j)
+      if (info[j].package == info[i].package && !info[j].smt_rank &&
+          info[j].core < info[i].core)
+        info[i].core_rank++;
+
+  sort_placement = placement;
+  qsort(info, n, sizeof(*info), compare_cpus);
+
+  if (n > max) n = max;
+  for (int i = 0; i < n; ++i) cpus[i] = info[i].cpu;
+
+  free(info);
+  return n;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int cpu_attr_pin(pthread_attr_t *attr, int cpu) {
+#if defined __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  int rc = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int cpu_pin_self(int cpu) {
+#if defined __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
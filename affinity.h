@@ -0,0 +1,30 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+
+// how threads are laid out over the cpus when none are listed explicitly
+enum placement {
+  // leave it to the scheduler
+  PLACEMENT_NONE,
+  // fill up the physical cores of one socket, then their SMT siblings,
+  // before moving on to the next socket
+  PLACEMENT_COMPACT,
+  // alternate between the sockets, physical cores before SMT siblings
+  PLACEMENT_SPREAD,
+};
+
+// parses a list such as "0-3,8,10-11" into cpus, returns the count or -1
+int cpu_list_parse(const char *list, int *cpus, int max);
+
+// the cpus the process may run on, in the order the placement would use
+// them, returns the count or -1 if the topology can't be read
+int cpu_placement(enum placement placement, int *cpus, int max);
+
+// makes the threads created with attr run on the cpu only
+int cpu_attr_pin(pthread_attr_t *attr, int cpu);
+
+// moves the calling thread to the cpu and keeps it there
+int cpu_pin_self(int cpu);
+
+#endif
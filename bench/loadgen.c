@@ -0,0 +1,429 @@
+// HTTP load generator for libdill_playground. Every thread runs its share of
+// the connections as libdill coroutines, each sending requests back to back
+// for the duration of the run, and the latencies of all of them are merged
+// into one histogram at the end.
+
+#include <errno.h>
+#include <getopt.h>
+#include <libdill.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "hist.h"
+
+#define MAX_BODY_SIZES 16
+#define RESPONSE_BUF_SZ 16384u
+
+static struct {
+  const char *host;
+  int port;
+  int connections;
+  int threads;
+  int duration_ms;
+  // requests sent over one connection before it is closed, 1 = no keep-alive
+  int keepalive;
+  // percentage of POST requests, the rest are GETs
+  int post_ratio;
+  // POST bodies are picked from these sizes in turn
+  unsigned long body_sizes[MAX_BODY_SIZES];
+  int n_body_sizes;
+  const char *path;
+  int timeout_ms;
+  bool csv;
+} config = {
+    .host = "127.0.0.1",
+    .port = 1234,
+    .connections = 64,
+    .threads = 1,
+    .duration_ms = 10000,
+    .keepalive = 100,
+    .post_ratio = 0,
+    .body_sizes = {1024},
+    .n_body_sizes = 1,
+    .path = "/",
+    .timeout_ms = 5000,
+};
+
+struct thread_ctx {
+  pthread_t thread;
+  int id;
+  int connections;
+  int64_t end;
+  struct ipaddr addr;
+  // the coroutines tell they're finished through this channel
+  int done[2];
+  uint64_t requests;
+  uint64_t errors;
+  // responses with a status other than 2xx
+  uint64_t non_2xx;
+  uint64_t bytes_out;
+  struct hist latency;
+};
+
+static char *post_body;
+
+// libdill's now() only has millisecond resolution
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static uint32_t xorshift32(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// sends one request over the TCP connection *s and reads the response,
+// returns 1 if the server keeps the connection open, 0 if it doesn't and -1
+// on error, with *s pointing at whatever handle has to be closed
+static int do_request(struct thread_ctx *t, int *s, bool post,
+                      unsigned long body_len, bool last, char *buf) {
+  int64_t deadline = now() + config.timeout_ms;
+  char value[256];
+  char name[256];
+
+  int h = http_attach(*s);
+  if (h < 0) return -1;
+  *s = h;
+
+  int rc = http_sendrequest(h, post ? "POST" : "GET", config.path, deadline);
+  if (rc < 0) return -1;
+  rc = http_sendfield(h, "Host", config.host, deadline);
+  if (rc < 0) return -1;
+  if (post) {
+    snprintf(value, sizeof(value), "%lu", body_len);
+    rc = http_sendfield(h, "Content-Length", value, deadline);
+    if (rc < 0) return -1;
+  }
+  rc = http_sendfield(h, "Connection", last ? "close" : "keep-alive",
+                      deadline);
+  if (rc < 0) return -1;
+  rc = http_done(h, deadline);
+  if (rc < 0) return -1;
+
+  // the server answers as soon as it has the headers, and reads the body
+  // after that
+  int status = http_recvstatus(h, value, sizeof(value), deadline);
+  if (status < 0) return -1;
+
+  unsigned long length = 0;
+  bool keep_alive = !last;
+  while (1) {
+    rc = http_recvfield(h, name, sizeof(name), value, sizeof(value),
+                        deadline);
+    if (rc < 0) {
+      if (errno == EPIPE) break;
+      return -1;
+    }
+    if (strcasecmp(name, "Content-Length") == 0)
+      length = strtoul(value, NULL, 10);
+    else if (strcasecmp(name, "Connection") == 0 &&
+             strcasecmp(value, "close") == 0)
+      keep_alive = false;
+  }
+
+  h = http_detach(h, deadline);
+  if (h < 0) return -1;
+  *s = h;
+
+  if (post && status / 100 == 2) {
+    rc = bsend(h, post_body, body_len, deadline);
+    if (rc < 0) return -1;
+    t->bytes_out += body_len;
+  }
+
+  while (length) {
+    size_t n = length < RESPONSE_BUF_SZ ? length : RESPONSE_BUF_SZ;
+    rc = brecv(h, buf, n, deadline);
+    if (rc < 0) return -1;
+    length -= n;
+  }
+
+  if (status / 100 != 2) t->non_2xx++;
+
+  return keep_alive;
+}
+
+static coroutine void client(struct thread_ctx *t, int index) {
+  uint32_t seed = (uint32_t)(t->id * 7919 + index) | 1;
+  unsigned next_size = index;
+  char *buf = malloc(RESPONSE_BUF_SZ);
+
+  while (buf && now() < t->end) {
+    int s = tcp_connect(&t->addr, now() + config.timeout_ms);
+    if (s < 0) {
+      t->errors++;
+      // don't spin on a server that isn't there
+      msleep(now() + 10);
+      continue;
+    }
+
+    int rc = 1;
+    for (int i = 0; i < config.keepalive && rc > 0 && now() < t->end; ++i) {
+      bool post = (int)(xorshift32(&seed) % 100) < config.post_ratio;
+      unsigned long body_len =
+          config.body_sizes[next_size++ % config.n_body_sizes];
+      bool last = i + 1 == config.keepalive;
+
+      uint64_t start = now_us();
+      rc = do_request(t, &s, post, body_len, last, buf);
+      if (rc < 0) {
+        t->errors++;
+        break;
+      }
+      hist_record(&t->latency, now_us() - start);
+      t->requests++;
+    }
+
+    // tcp_close() closes the handle even when the shutdown fails
+    if (rc < 0)
+      hclose(s);
+    else
+      tcp_close(s, now() + config.timeout_ms);
+  }
+
+  free(buf);
+  int dummy = 0;
+  chsend(t->done[0], &dummy, sizeof(dummy), -1);
+}
+
+static void *run_thread(void *arg) {
+  struct thread_ctx *t = arg;
+
+  if (ipaddr_remote(&t->addr, config.host, config.port, 0,
+                    now() + config.timeout_ms) < 0) {
+    perror("Can't resolve the server's address");
+    return NULL;
+  }
+
+  if (chmake(t->done) < 0) {
+    perror("Can't create a channel");
+    return NULL;
+  }
+
+  int *crs = malloc(t->connections * sizeof(int));
+  int started = 0;
+  for (int i = 0; crs && i < t->connections; ++i) {
+    int cr = go(client(t, i));
+    if (cr < 0) {
+      perror("Can't start a coroutine");
+      break;
+    }
+    crs[started++] = cr;
+  }
+
+  for (int i = 0; i < started; ++i) {
+    int dummy;
+    chrecv(t->done[1], &dummy, sizeof(dummy), -1);
+  }
+
+  for (int i = 0; i < started; ++i) hclose(crs[i]);
+  free(crs);
+  hclose(t->done[0]);
+  hclose(t->done[1]);
+
+  return NULL;
+}
+
+static int parse_sizes(const char *arg) {
+  int n = 0;
+  char *end;
+
+  while (*arg && n < MAX_BODY_SIZES) {
+    config.body_sizes[n++] = strtoul(arg, &end, 10);
+    if (end == arg) return -1;
+    arg = *end == ',' ? end + 1 : end;
+  }
+  if (*arg || !n) return -1;
+
+  config.n_body_sizes = n;
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -H, --host HOST    server to connect to (default 127.0.0.1)\n"
+          "  -p, --port PORT    server port (default 1234)\n"
+          "  -c, --connections N\n"
+          "                     concurrent connections (default 64)\n"
+          "  -T, --threads N    threads the connections are spread over "
+          "(default 1)\n"
+          "  -d, --duration S   seconds to run for (default 10)\n"
+          "  -k, --keepalive N  requests per connection, 1 disables "
+          "keep-alive (default 100)\n"
+          "  -P, --post PCT     percentage of POST requests (default 0)\n"
+          "  -b, --body-sizes L comma separated POST body sizes, used in "
+          "turn (default 1024)\n"
+          "  -u, --path PATH    resource to request (default /)\n"
+          "  -t, --timeout MS   deadline of every request (default 5000)\n"
+          "      --csv          print a CSV header and row instead of a "
+          "summary\n"
+          "  -h, --help         show this message\n",
+          prog);
+}
+
+static int parse_args(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"host", required_argument, NULL, 'H'},
+      {"port", required_argument, NULL, 'p'},
+      {"connections", required_argument, NULL, 'c'},
+      {"threads", required_argument, NULL, 'T'},
+      {"duration", required_argument, NULL, 'd'},
+      {"keepalive", required_argument, NULL, 'k'},
+      {"post", required_argument, NULL, 'P'},
+      {"body-sizes", required_argument, NULL, 'b'},
+      {"path", required_argument, NULL, 'u'},
+      {"timeout", required_argument, NULL, 't'},
+      {"csv", no_argument, NULL, 'C'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "H:p:c:T:d:k:P:b:u:t:h", options,
+                            NULL)) != -1) {
+    switch (opt) {
+      case 'H':
+        config.host = optarg;
+        break;
+      case 'p':
+        config.port = atoi(optarg);
+        break;
+      case 'c':
+        config.connections = atoi(optarg);
+        break;
+      case 'T':
+        config.threads = atoi(optarg);
+        break;
+      case 'd':
+        config.duration_ms = (int)(atof(optarg) * 1000);
+        break;
+      case 'k':
+        config.keepalive = atoi(optarg);
+        break;
+      case 'P':
+        config.post_ratio = atoi(optarg);
+        break;
+      case 'b':
+        if (parse_sizes(optarg) < 0) {
+          fprintf(stderr, "Bad body size list: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'u':
+        config.path = optarg;
+        break;
+      case 't':
+        config.timeout_ms = atoi(optarg);
+        break;
+      case 'C':
+        config.csv = true;
+        break;
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+
+  if (config.connections < 1 || config.threads < 1 || config.keepalive < 1 ||
+      config.threads > config.connections) {
+    fprintf(stderr, "Need at least one request per connection and one "
+                    "connection per thread\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (parse_args(argc, argv) < 0) return 1;
+
+  unsigned long max_body = 0;
+  for (int i = 0; i < config.n_body_sizes; ++i)
+    if (config.body_sizes[i] > max_body) max_body = config.body_sizes[i];
+  post_body = malloc(max_body ? max_body : 1);
+  struct thread_ctx *threads = calloc(config.threads, sizeof(*threads));
+  if (!post_body || !threads) {
+    perror("Can't allocate");
+    return 1;
+  }
+  memset(post_body, 'x', max_body);
+
+  uint64_t start = now_us();
+  int64_t end = now() + config.duration_ms;
+
+  for (int i = 0; i < config.threads; ++i) {
+    struct thread_ctx *t = &threads[i];
+    t->id = i;
+    // spread the remainder over the first threads
+    t->connections = config.connections / config.threads +
+                     (i < config.connections % config.threads);
+    t->end = end;
+    hist_init(&t->latency);
+
+    int rc = pthread_create(&t->thread, NULL, run_thread, t);
+    if (rc != 0) {
+      perror("Can't create a thread");
+      return 1;
+    }
+  }
+
+  struct hist *latency = malloc(sizeof(*latency));
+  if (!latency) {
+    perror("Can't allocate a histogram");
+    return 1;
+  }
+  hist_init(latency);
+
+  uint64_t requests = 0, errors = 0, non_2xx = 0, bytes_out = 0;
+  for (int i = 0; i < config.threads; ++i) {
+    pthread_join(threads[i].thread, NULL);
+    hist_merge(latency, &threads[i].latency);
+    requests += threads[i].requests;
+    errors += threads[i].errors;
+    non_2xx += threads[i].non_2xx;
+    bytes_out += threads[i].bytes_out;
+  }
+
+  double seconds = (now_us() - start) / 1e6;
+  unsigned long long p50 = hist_percentile(latency, 0.5);
+  unsigned long long p99 = hist_percentile(latency, 0.99);
+  unsigned long long p999 = hist_percentile(latency, 0.999);
+  unsigned long long max = atomic_load(&latency->max);
+
+  if (config.csv) {
+    printf("connections,threads,keepalive,post_pct,requests,errors,non_2xx,"
+           "seconds,rps,p50_us,p99_us,p999_us,max_us\n");
+    printf("%d,%d,%d,%d,%llu,%llu,%llu,%.3f,%.0f,%llu,%llu,%llu,%llu\n",
+           config.connections, config.threads, config.keepalive,
+           config.post_ratio, (unsigned long long)requests,
+           (unsigned long long)errors, (unsigned long long)non_2xx, seconds,
+           requests / seconds, p50, p99, p999, max);
+  } else {
+    printf("%llu requests in %.2fs, %llu errors, %llu non-2xx\n",
+           (unsigned long long)requests, seconds, (unsigned long long)errors,
+           (unsigned long long)non_2xx);
+    printf("Requests/sec: %.0f\n", requests / seconds);
+    printf("Body bytes sent: %llu\n", (unsigned long long)bytes_out);
+    printf("Latency p50 %lluus, p99 %lluus, p99.9 %lluus, max %lluus\n", p50,
+           p99, p999, max);
+  }
+
+  free(latency);
+  free(threads);
+  free(post_body);
+
+  return errors && !requests ? 1 : 0;
+}
@@ -0,0 +1,343 @@
+// Microbenchmark of rpa_queue: throughput and push-to-pop latency for
+// single/multi producer and consumer setups, printed as CSV, one line per
+// case, so that runs of two implementations can be diffed or plotted.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hist.h"
+#include "rpa_queue.h"
+
+#define MAX_THREADS 64
+#define MAX_LIST 16
+#define BATCH 16
+#define TIMED_WAIT_MS 10
+// ends a consumer, the timestamps carried by all other items are non-zero
+#define END_MARKER ((void *)0)
+
+enum variant {
+  // rpa_queue_push/rpa_queue_pop
+  VARIANT_BLOCKING,
+  // rpa_queue_trypush/rpa_queue_trypop, yielding while they fail
+  VARIANT_TRY,
+  // rpa_queue_timedpush/rpa_queue_timedpop, retrying on timeout
+  VARIANT_TIMED,
+  // rpa_queue_push_batch/rpa_queue_pop_batch
+  VARIANT_BATCH,
+  VARIANT_COUNT,
+};
+
+static const char *variant_names[] = {"blocking", "try", "timed", "batch"};
+
+// the synchronization rpa_queue was built on, which every case (the lock-free
+// ring's parking included) goes through
+#ifdef RPA_QUEUE_FUTEX
+#define BACKEND "futex"
+#else
+#define BACKEND "pthread"
+#endif
+
+static struct {
+  uint32_t ops;
+  uint32_t capacities[MAX_LIST];
+  int n_capacities;
+  int threads[MAX_LIST];
+  int n_threads;
+  int repeat;
+} config = {
+    .ops = 200000,
+    .capacities = {16, 64, 1024},
+    .n_capacities = 3,
+    .threads = {2, 4},
+    .n_threads = 2,
+    .repeat = 1,
+};
+
+struct bench {
+  rpa_queue_t *queue;
+  enum variant variant;
+  uint32_t ops;
+};
+
+struct consumer {
+  struct bench *bench;
+  pthread_t thread;
+  uint64_t popped;
+  struct hist latency;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void push_one(struct bench *b, void *item) {
+  switch (b->variant) {
+    case VARIANT_TRY:
+      while (!rpa_queue_trypush(b->queue, item)) sched_yield();
+      break;
+    case VARIANT_TIMED:
+      while (!rpa_queue_timedpush(b->queue, item, TIMED_WAIT_MS)) continue;
+      break;
+    default:
+      // false means the wait was interrupted, there's no termination here
+      while (!rpa_queue_push(b->queue, item)) continue;
+      break;
+  }
+}
+
+static void *producer(void *arg) {
+  struct bench *b = arg;
+
+  if (b->variant == VARIANT_BATCH) {
+    void *items[BATCH];
+    for (uint32_t i = 0; i < b->ops; i += BATCH) {
+      uint32_t n = b->ops - i < BATCH ? b->ops - i : BATCH;
+      uint64_t stamp = now_ns();
+      for (uint32_t j = 0; j < n; ++j) items[j] = (void *)(uintptr_t)stamp;
+
+      for (uint32_t done = 0; done < n;)
+        done += rpa_queue_push_batch(b->queue, items + done, n - done);
+    }
+  } else {
+    for (uint32_t i = 0; i < b->ops; ++i)
+      push_one(b, (void *)(uintptr_t)now_ns());
+  }
+
+  return NULL;
+}
+
+static uint32_t pop_some(struct bench *b, void **items) {
+  switch (b->variant) {
+    case VARIANT_TRY:
+      while (!rpa_queue_trypop(b->queue, items)) sched_yield();
+      return 1;
+    case VARIANT_TIMED:
+      while (!rpa_queue_timedpop(b->queue, items, TIMED_WAIT_MS)) continue;
+      return 1;
+    case VARIANT_BATCH: {
+      uint32_t n;
+      while (!(n = rpa_queue_pop_batch(b->queue, items, BATCH,
+                                       RPA_WAIT_FOREVER)))
+        continue;
+      return n;
+    }
+    default:
+      while (!rpa_queue_pop(b->queue, items)) continue;
+      return 1;
+  }
+}
+
+static void *consumer(void *arg) {
+  struct consumer *c = arg;
+  void *items[BATCH];
+
+  while (1) {
+    uint32_t n = pop_some(c->bench, items);
+    uint64_t now = now_ns();
+    uint32_t markers = 0;
+
+    for (uint32_t i = 0; i < n; ++i) {
+      if (items[i] == END_MARKER) {
+        markers++;
+        continue;
+      }
+      hist_record(&c->latency, now - (uint64_t)(uintptr_t)items[i]);
+      c->popped++;
+    }
+
+    if (markers) {
+      // a batch may hold the markers of other consumers too
+      while (--markers) push_one(c->bench, END_MARKER);
+      return NULL;
+    }
+  }
+}
+
+static void run_case(const char *topology, const char *impl, int flags,
+                     enum variant variant, uint32_t capacity, int producers,
+                     int consumers) {
+  struct bench b = {.variant = variant, .ops = config.ops};
+
+  if (!rpa_queue_create_ex(&b.queue, capacity, flags)) {
+    perror("Can't initialize a queue");
+    exit(1);
+  }
+
+  pthread_t prod[MAX_THREADS];
+  struct consumer *cons = calloc(consumers, sizeof(*cons));
+  if (!cons) {
+    perror("Can't allocate the consumers");
+    exit(1);
+  }
+
+  uint64_t start = now_ns();
+
+  for (int i = 0; i < consumers; ++i) {
+    cons[i].bench = &b;
+    hist_init(&cons[i].latency);
+    if (pthread_create(&cons[i].thread, NULL, consumer, &cons[i]) != 0) {
+      perror("Can't create a thread");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < producers; ++i) {
+    if (pthread_create(&prod[i], NULL, producer, &b) != 0) {
+      perror("Can't create a thread");
+      exit(1);
+    }
+  }
+
+  for (int i = 0; i < producers; ++i) pthread_join(prod[i], NULL);
+  // all items are queued ahead of the markers
+  for (int i = 0; i < consumers; ++i) push_one(&b, END_MARKER);
+
+  struct hist *latency = malloc(sizeof(*latency));
+  if (!latency) {
+    perror("Can't allocate a histogram");
+    exit(1);
+  }
+  hist_init(latency);
+
+  uint64_t popped = 0;
+  for (int i = 0; i < consumers; ++i) {
+    pthread_join(cons[i].thread, NULL);
+    hist_merge(latency, &cons[i].latency);
+    popped += cons[i].popped;
+  }
+
+  double seconds = (now_ns() - start) / 1e9;
+
+  printf("%s,%s,%s,%s,%u,%d,%d,%llu,%.6f,%.0f,%llu,%llu,%llu,%llu\n",
+         topology, BACKEND, impl, variant_names[variant], b.queue->bounds, producers, consumers,
+         (unsigned long long)popped, seconds, popped / seconds,
+         (unsigned long long)hist_percentile(latency, 0.5),
+         (unsigned long long)hist_percentile(latency, 0.99),
+         (unsigned long long)hist_percentile(latency, 0.999),
+         (unsigned long long)atomic_load(&latency->max));
+  fflush(stdout);
+
+  free(latency);
+  free(cons);
+  rpa_queue_destroy(b.queue);
+  free(b.queue);
+}
+
+static int parse_list(const char *arg, uint32_t *out) {
+  int n = 0;
+  char *end;
+
+  while (*arg && n < MAX_LIST) {
+    unsigned long v = strtoul(arg, &end, 10);
+    if (end == arg || v == 0) return -1;
+    out[n++] = (uint32_t)v;
+    arg = *end == ',' ? end + 1 : end;
+  }
+
+  return *arg ? -1 : n;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n, --ops N        items pushed by every producer (default "
+          "200000)\n"
+          "  -c, --capacity L   comma separated queue capacities (default "
+          "16,64,1024)\n"
+          "  -t, --threads L    comma separated thread counts for the mpsc "
+          "and mpmc cases\n"
+          "                     (default 2,4)\n"
+          "  -r, --repeat N     run every case N times (default 1)\n"
+          "  -h, --help         show this message\n"
+          "\n"
+          "Prints one CSV line per case, latencies are push to pop in "
+          "nanoseconds.\n",
+          prog);
+}
+
+static int parse_args(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"ops", required_argument, NULL, 'n'},
+      {"capacity", required_argument, NULL, 'c'},
+      {"threads", required_argument, NULL, 't'},
+      {"repeat", required_argument, NULL, 'r'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  uint32_t list[MAX_LIST];
+  int opt, n;
+  while ((opt = getopt_long(argc, argv, "n:c:t:r:h", options, NULL)) != -1) {
+    switch (opt) {
+      case 'n':
+        config.ops = strtoul(optarg, NULL, 10);
+        break;
+      case 'c':
+        n = parse_list(optarg, config.capacities);
+        if (n < 0) {
+          fprintf(stderr, "Bad capacity list: %s\n", optarg);
+          return -1;
+        }
+        config.n_capacities = n;
+        break;
+      case 't':
+        n = parse_list(optarg, list);
+        if (n < 0) {
+          fprintf(stderr, "Bad thread count list: %s\n", optarg);
+          return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+          if (list[i] > MAX_THREADS) {
+            fprintf(stderr, "At most %d threads\n", MAX_THREADS);
+            return -1;
+          }
+          config.threads[i] = (int)list[i];
+        }
+        config.n_threads = n;
+        break;
+      case 'r':
+        config.repeat = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (parse_args(argc, argv) < 0) return 1;
+
+  printf("topology,backend,impl,variant,capacity,producers,consumers,ops,"
+         "seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+
+  for (int r = 0; r < config.repeat; ++r) {
+    for (int c = 0; c < config.n_capacities; ++c) {
+      uint32_t cap = config.capacities[c];
+
+      for (int v = 0; v < VARIANT_COUNT; ++v) {
+        run_case("spsc", "mutex", 0, v, cap, 1, 1);
+        run_case("spsc", "lockfree", RPA_QUEUE_SPSC, v, cap, 1, 1);
+
+        for (int t = 0; t < config.n_threads; ++t) {
+          int n = config.threads[t];
+          run_case("mpsc", "mutex", 0, v, cap, n, 1);
+          run_case("mpmc", "mutex", 0, v, cap, n, n);
+        }
+      }
+    }
+  }
+
+  return 0;
+}
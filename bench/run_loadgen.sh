@@ -0,0 +1,47 @@
+#!/bin/sh
+# Runs libdill_loadgen against libdill_playground over loopback for every
+# server thread count, printing one CSV row per run.
+#
+#   BIN=build/bin THREADS="1 2 4" bench/run_loadgen.sh [loadgen options]
+#
+# Options are passed on to the load generator, e.g. -c 256 -P 20 -b 64,4096.
+
+set -e
+
+BIN=${BIN:-bin}
+THREADS=${THREADS:-"1 2 4"}
+PORT=${PORT:-18080}
+# extra server options, e.g. "-m reuseport"
+SERVER_OPTS=${SERVER_OPTS:-}
+
+server=$BIN/libdill_playground
+loadgen=$BIN/libdill_loadgen
+
+for bin in "$server" "$loadgen"; do
+  if [ ! -x "$bin" ]; then
+    echo "$bin not found, build first or set BIN" >&2
+    exit 1
+  fi
+done
+
+header=1
+for threads in $THREADS; do
+  # shellcheck disable=SC2086
+  "$server" -p "$PORT" -t "$threads" -a 0 $SERVER_OPTS >/dev/null &
+  pid=$!
+  trap 'kill -INT $pid 2>/dev/null' EXIT
+
+  # give the server a moment to listen
+  sleep 1
+
+  "$loadgen" -p "$PORT" --csv "$@" | {
+    read -r columns
+    if [ $header = 1 ]; then echo "server_threads,$columns"; fi
+    while read -r row; do echo "$threads,$row"; done
+  }
+  header=0
+
+  kill -INT $pid
+  wait $pid || true
+  trap - EXIT
+done
@@ -0,0 +1,82 @@
+#include "buf_pool.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+
+// precedes every buffer, keeps it aligned for any type
+struct buf_hdr {
+  alignas(max_align_t) struct buf_hdr *next;
+  size_t size;
+  unsigned cls;
+};
+
+static unsigned size_class(size_t size) {
+  unsigned cls = 0;
+  while (cls < BUF_POOL_CLASSES &&
+         ((size_t)1 << (BUF_POOL_MIN_SHIFT + cls)) < size)
+    ++cls;
+  return cls;
+}
+
+void buf_pool_init(struct buf_pool *pool, size_t class_budget) {
+  for (unsigned i = 0; i < BUF_POOL_CLASSES; ++i) {
+    pool->free[i] = NULL;
+    pool->cached[i] = 0;
+  }
+  pool->class_budget = class_budget;
+}
+
+void buf_pool_destroy(struct buf_pool *pool) {
+  for (unsigned i = 0; i < BUF_POOL_CLASSES; ++i) {
+    while (pool->free[i]) {
+      struct buf_hdr *hdr = pool->free[i];
+      pool->free[i] = hdr->next;
+      free(hdr);
+    }
+    pool->cached[i] = 0;
+  }
+}
+
+void *buf_pool_get(struct buf_pool *pool, size_t size) {
+  unsigned cls = size_class(size);
+
+  if (cls < BUF_POOL_CLASSES && pool->free[cls]) {
+    struct buf_hdr *hdr = pool->free[cls];
+    pool->free[cls] = hdr->next;
+    pool->cached[cls] -= hdr->size;
+    return hdr + 1;
+  }
+
+  // oversized buffers are allocated to measure and never cached
+  if (cls < BUF_POOL_CLASSES) size = (size_t)1 << (BUF_POOL_MIN_SHIFT + cls);
+
+  struct buf_hdr *hdr = malloc(sizeof(struct buf_hdr) + size);
+  if (!hdr) return NULL;
+
+  hdr->next = NULL;
+  hdr->size = size;
+  hdr->cls = cls;
+
+  return hdr + 1;
+}
+
+void buf_pool_put(struct buf_pool *pool, void *buf) {
+  if (!buf) return;
+
+  struct buf_hdr *hdr = (struct buf_hdr *)buf - 1;
+  unsigned cls = hdr->cls;
+
+  if (cls >= BUF_POOL_CLASSES ||
+      pool->cached[cls] + hdr->size > pool->class_budget) {
+    free(hdr);
+    return;
+  }
+
+  hdr->next = pool->free[cls];
+  pool->free[cls] = hdr;
+  pool->cached[cls] += hdr->size;
+}
+
+size_t buf_pool_size(const void *buf) {
+  return ((const struct buf_hdr *)buf - 1)->size;
+}
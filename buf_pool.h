@@ -0,0 +1,37 @@
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+
+// smallest size class is 1 KiB, every next one is twice as large
+#define BUF_POOL_MIN_SHIFT 10
+// classes up to 1 MiB are recycled, larger buffers go straight to malloc
+#define BUF_POOL_CLASSES 11
+
+struct buf_hdr;
+
+// Free lists of buffers in power-of-two size classes. A pool belongs to one
+// thread and does no locking, so threads never contend on the allocator for
+// request buffers.
+struct buf_pool {
+  struct buf_hdr *free[BUF_POOL_CLASSES];
+  size_t cached[BUF_POOL_CLASSES];
+  // upper bound on the bytes kept around in each class
+  size_t class_budget;
+};
+
+void buf_pool_init(struct buf_pool *pool, size_t class_budget);
+
+// releases the cached buffers, buffers still handed out stay valid
+void buf_pool_destroy(struct buf_pool *pool);
+
+// returns a buffer of at least size bytes, NULL if out of memory
+void *buf_pool_get(struct buf_pool *pool, size_t size);
+
+// gives a buffer back to the pool it was taken from
+void buf_pool_put(struct buf_pool *pool, void *buf);
+
+// the usable size of a buffer returned by buf_pool_get
+size_t buf_pool_size(const void *buf);
+
+#endif
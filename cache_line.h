@@ -0,0 +1,8 @@
+#ifndef CACHE_LINE_H
+#define CACHE_LINE_H
+
+// what shared counters and per thread blocks are aligned to, so that threads
+// don't false share
+#define RPA_CACHE_LINE 64
+
+#endif
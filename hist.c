@@ -0,0 +1,76 @@
+#include "hist.h"
+
+static unsigned bucket_of(uint64_t value) {
+  if (value < HIST_SUB_COUNT) return (unsigned)value;
+
+  unsigned msb = 63 - __builtin_clzll(value);
+  if (msb >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+
+  unsigned shift = msb - HIST_SUB_BITS;
+  return HIST_SUB_COUNT * (shift + 1) +
+         (unsigned)((value >> shift) - HIST_SUB_COUNT);
+}
+
+static uint64_t bucket_max(unsigned bucket) {
+  if (bucket < HIST_SUB_COUNT) return bucket;
+
+  unsigned shift = bucket / HIST_SUB_COUNT - 1;
+  uint64_t sub = bucket % HIST_SUB_COUNT;
+  return ((HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+static void add(_Atomic uint64_t *counter, uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static uint64_t get(const _Atomic uint64_t *counter) {
+  return atomic_load_explicit((_Atomic uint64_t *)counter,
+                              memory_order_relaxed);
+}
+
+void hist_init(struct hist *h) {
+  atomic_init(&h->count, 0);
+  atomic_init(&h->sum, 0);
+  atomic_init(&h->max, 0);
+  for (unsigned i = 0; i < HIST_BUCKETS; ++i) atomic_init(&h->buckets[i], 0);
+}
+
+void hist_record(struct hist *h, uint64_t value) {
+  add(&h->buckets[bucket_of(value)], 1);
+  add(&h->count, 1);
+  add(&h->sum, value);
+  if (value > get(&h->max))
+    atomic_store_explicit(&h->max, value, memory_order_relaxed);
+}
+
+void hist_merge(struct hist *dst, const struct hist *src) {
+  add(&dst->count, get(&src->count));
+  add(&dst->sum, get(&src->sum));
+  if (get(&src->max) > get(&dst->max))
+    atomic_store_explicit(&dst->max, get(&src->max), memory_order_relaxed);
+  for (unsigned i = 0; i < HIST_BUCKETS; ++i)
+    add(&dst->buckets[i], get(&src->buckets[i]));
+}
+
+uint64_t hist_percentile(const struct hist *h, double fraction) {
+  uint64_t count = get(&h->count);
+  if (!count) return 0;
+
+  uint64_t rank = (uint64_t)(fraction * (double)count);
+  if (rank >= count) rank = count - 1;
+
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+    seen += get(&h->buckets[i]);
+    if (seen > rank) {
+      // the last bucket also holds everything too large to tell apart
+      uint64_t max = get(&h->max);
+      uint64_t upper = bucket_max(i);
+      return upper < max && i != HIST_BUCKETS - 1 ? upper : max;
+    }
+  }
+
+  return get(&h->max);
+}
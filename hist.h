@@ -0,0 +1,36 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// values below 2^HIST_SUB_BITS get a bucket each, every larger power of two
+// is split into 2^HIST_SUB_BITS buckets, i.e. about 6% relative precision
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1u << HIST_SUB_BITS)
+// the largest value told apart is 2^HIST_MAX_BITS - 1
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS (HIST_SUB_COUNT * (HIST_MAX_BITS - HIST_SUB_BITS + 1))
+
+// HDR-style log-linear histogram. It has a single writer: hist_record does
+// plain relaxed loads and stores, while any thread may read it concurrently.
+struct hist {
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+  _Atomic uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct hist *h);
+
+// must only be called by the histogram's owner
+void hist_record(struct hist *h, uint64_t value);
+
+// adds the counts of src into dst, which the caller owns
+void hist_merge(struct hist *dst, const struct hist *src);
+
+// the value at or below which the given fraction (0..1) of samples lie,
+// reported as the upper bound of its bucket
+uint64_t hist_percentile(const struct hist *h, double fraction);
+
+#endif
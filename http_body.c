@@ -0,0 +1,193 @@
+#include "http_body.h"
+
+#include <errno.h>
+#include <libdill.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// longest chunk size or trailer line accepted, extensions included
+#define LINE_MAX_SZ 1024u
+
+// receives a CRLF terminated line, returns its length without the CRLF
+static long recv_line(const struct http_body_source *src, char *line,
+                      size_t len, int64_t deadline) {
+  size_t n = 0;
+
+  while (1) {
+    char c;
+    int rc = src->recv(src->arg, &c, 1, deadline);
+    if (rc < 0) return -1;
+
+    if (c == '\n') break;
+    if (n + 1 == len) {
+      errno = EPROTO;
+      return -1;
+    }
+    line[n++] = c;
+  }
+
+  if (n && line[n - 1] == '\r') --n;
+  line[n] = '\0';
+
+  return (long)n;
+}
+
+// hands len bytes of the body to the handler, slice by slice
+static int recv_slices(const struct http_body_source *src, unsigned long len,
+                       char *buf, size_t bufsz,
+                       const struct http_body_handler *handler,
+                       int64_t deadline) {
+  while (len) {
+    size_t n = len < bufsz ? len : bufsz;
+
+    int rc = src->recv(src->arg, buf, n, deadline);
+    if (rc < 0) return -1;
+
+    if (handler->on_data(handler->arg, buf, n) < 0) {
+      errno = ECONNABORTED;
+      return -1;
+    }
+
+    len -= n;
+  }
+
+  return 0;
+}
+
+// Parses chunk-size [BWS ; chunk-ext] strictly: 1*HEXDIG with no sign, 0x
+// or leading whitespace, which strtoul() would take. A proxy in front may
+// read a lenient size differently and smuggle a request past us.
+static int parse_chunk_size(const char *line, unsigned long *size) {
+  const char *p = line;
+  unsigned long v = 0;
+  for (;; ++p) {
+    unsigned d;
+    if (*p >= '0' && *p <= '9') {
+      d = (unsigned)(*p - '0');
+    } else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+      d = (unsigned)((*p | 0x20) - 'a' + 10);
+    } else {
+      break;
+    }
+    if (v > (ULONG_MAX - d) / 16) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    v = v * 16 + d;
+  }
+  if (p == line) goto malformed;
+
+  while (*p == ' ' || *p == '\t') ++p;
+  if (*p && *p != ';') goto malformed;
+
+  *size = v;
+  return 0;
+
+malformed:
+  errno = EPROTO;
+  return -1;
+}
+
+static long recv_chunked(const struct http_body_source *src,
+                         const struct http_body *body, char *buf,
+                         size_t bufsz, const struct http_body_handler *handler,
+                         int64_t deadline) {
+  char line[LINE_MAX_SZ];
+  unsigned long total = 0;
+
+  while (1) {
+    // chunk-size [; chunk-ext] CRLF
+    if (recv_line(src, line, sizeof(line), deadline) < 0) return -1;
+
+    unsigned long size;
+    if (parse_chunk_size(line, &size) < 0) return -1;
+
+    if (!size) break;
+
+    if (size > body->limit || total + size > body->limit) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+    if (recv_slices(src, size, buf, bufsz, handler, deadline) < 0) return -1;
+    total += size;
+
+    // every chunk's data is followed by a CRLF of its own
+    long rc = recv_line(src, line, sizeof(line), deadline);
+    if (rc < 0) return -1;
+    if (rc) {
+      errno = EPROTO;
+      return -1;
+    }
+  }
+
+  // skip the trailer fields up to the empty line ending the body
+  while (1) {
+    long rc = recv_line(src, line, sizeof(line), deadline);
+    if (rc < 0) return -1;
+    if (!rc) break;
+  }
+
+  return (long)total;
+}
+
+static int recv_socket(void *arg, void *buf, size_t len, int64_t deadline) {
+  return brecv(*(int *)arg, buf, len, deadline);
+}
+
+long http_body_recv(int s, const struct http_body *body, char *buf,
+                    size_t bufsz, const struct http_body_handler *handler,
+                    int64_t deadline) {
+  const struct http_body_source src = {.recv = recv_socket, .arg = &s};
+  return http_body_recv_from(&src, body, buf, bufsz, handler, deadline);
+}
+
+// a source holding the client to a minimum rate, which pushes each read's
+// deadline back by the time the bytes so far were allowed
+struct paced {
+  const struct http_body_source *src;
+  unsigned long min_rate;
+  uint64_t received;
+};
+
+static int recv_paced(void *arg, void *buf, size_t len, int64_t deadline) {
+  struct paced *p = arg;
+  p->received += len;
+  if (deadline < 0) return p->src->recv(p->src->arg, buf, len, deadline);
+
+  int64_t allowance = (int64_t)(p->received * 1000 / p->min_rate);
+  return p->src->recv(p->src->arg, buf, len, deadline + allowance);
+}
+
+long http_body_recv_from(const struct http_body_source *src,
+                         const struct http_body *body, char *buf,
+                         size_t bufsz, const struct http_body_handler *handler,
+                         int64_t deadline) {
+  long total;
+
+  struct paced paced = {src, body->min_rate, 0};
+  const struct http_body_source paced_src = {.recv = recv_paced,
+                                             .arg = &paced};
+  if (body->min_rate) src = &paced_src;
+
+  if (body->chunked) {
+    total = recv_chunked(src, body, buf, bufsz, handler, deadline);
+    if (total < 0) return -1;
+  } else {
+    if (body->length > body->limit) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    if (recv_slices(src, body->length, buf, bufsz, handler, deadline) < 0)
+      return -1;
+    total = (long)body->length;
+  }
+
+  if (handler->on_end && handler->on_end(handler->arg) < 0) {
+    errno = ECONNABORTED;
+    return -1;
+  }
+
+  return total;
+}
@@ -0,0 +1,52 @@
+#ifndef HTTP_BODY_H
+#define HTTP_BODY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Receives a request body slice by slice. The next slice isn't read off the
+// socket until on_data returns, so a handler which takes its time (e.g. one
+// blocking in libdill on I/O of its own) throttles the client through TCP
+// flow control instead of having the body buffered in memory.
+struct http_body_handler {
+  // called for every slice as it arrives, returns -1 to abort the request
+  int (*on_data)(void *arg, const char *data, size_t len);
+  // called once the whole body has been received, may be NULL
+  int (*on_end)(void *arg);
+  void *arg;
+};
+
+// framing of a request body as announced in its headers
+struct http_body {
+  // Transfer-Encoding: chunked, otherwise length bytes follow
+  bool chunked;
+  unsigned long length;
+  // largest body accepted, chunked bodies are only checked as they arrive
+  unsigned long limit;
+  // bytes per second the client has to keep up, every byte received pushes
+  // the deadline back by 1 / min_rate seconds; 0 = just the deadline
+  unsigned long min_rate;
+};
+
+// where a body is read from: recv receives exactly len bytes like brecv
+struct http_body_source {
+  int (*recv)(void *arg, void *buf, size_t len, int64_t deadline);
+  void *arg;
+};
+
+// Reads a body off the raw (detached) socket s in slices of at most bufsz
+// bytes of buf. Returns the body size or -1 with errno set to EMSGSIZE if it
+// exceeded the limit, EPROTO if the chunked framing is malformed,
+// ECONNABORTED if the handler aborted or whatever brecv reported.
+long http_body_recv(int s, const struct http_body *body, char *buf,
+                    size_t bufsz, const struct http_body_handler *handler,
+                    int64_t deadline);
+
+// http_body_recv() reading from src instead of a libdill socket
+long http_body_recv_from(const struct http_body_source *src,
+                         const struct http_body *body, char *buf,
+                         size_t bufsz, const struct http_body_handler *handler,
+                         int64_t deadline);
+
+#endif
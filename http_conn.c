@@ -0,0 +1,164 @@
+#include "http_conn.h"
+
+#include <errno.h>
+#include <libdill.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "http_parse.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+void http_conn_init(struct http_conn *c, int fd) {
+  memset(c, 0, sizeof(*c));
+  c->fd = fd;
+}
+
+void http_conn_set_buf(struct http_conn *c, char *buf, size_t size) {
+  c->buf = buf;
+  c->size = size;
+  c->start = 0;
+  c->end = 0;
+  c->scanned = 0;
+}
+
+// receives up to len bytes, waiting until there are any; 0 means EOF
+static ssize_t recv_some(int fd, char *buf, size_t len, int64_t deadline) {
+  while (1) {
+    ssize_t n = recv(fd, buf, len, 0);
+    if (n >= 0) return n;
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (fdin(fd, deadline) < 0) return -1;
+  }
+}
+
+// receives more into the buffer, moving the pending bytes to its front if
+// that makes room
+static ssize_t fill(struct http_conn *c, int64_t deadline) {
+  if (c->start && (c->start == c->end || c->end == c->size)) {
+    memmove(c->buf, c->buf + c->start, c->end - c->start);
+    c->end -= c->start;
+    c->start = 0;
+  }
+
+  ssize_t n = recv_some(c->fd, c->buf + c->end, c->size - c->end, deadline);
+  if (n > 0) c->end += (size_t)n;
+  return n;
+}
+
+long http_conn_recv_head(struct http_conn *c, int64_t deadline) {
+  while (1) {
+    size_t head =
+        http_head_end(c->buf + c->start, c->end - c->start, &c->scanned);
+    if (head) {
+      c->scanned = 0;
+      return (long)head;
+    }
+
+    if (c->start == 0 && c->end == c->size) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+    ssize_t n = fill(c, deadline);
+    if (n < 0) return -1;
+    if (n == 0) {
+      errno = c->end > c->start ? ECONNRESET : EPIPE;
+      return -1;
+    }
+  }
+}
+
+void http_conn_consume(struct http_conn *c, size_t n) {
+  c->start += n;
+  if (c->start == c->end) {
+    c->start = 0;
+    c->end = 0;
+  }
+}
+
+int http_conn_recv(void *conn, void *buf, size_t len, int64_t deadline) {
+  struct http_conn *c = conn;
+  char *out = buf;
+
+  while (len) {
+    size_t n = http_conn_pending(c);
+    if (n) {
+      if (n > len) n = len;
+      memcpy(out, c->buf + c->start, n);
+      http_conn_consume(c, n);
+      out += n;
+      len -= n;
+      continue;
+    }
+
+    // large reads go straight to the caller, small ones through the buffer
+    // so that a chunked body's lines don't take a recv() per byte
+    ssize_t rc = len >= c->size ? recv_some(c->fd, out, len, deadline)
+                                : fill(c, deadline);
+    if (rc < 0) return -1;
+    if (rc == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    if (len >= c->size) {
+      out += rc;
+      len -= (size_t)rc;
+    }
+  }
+
+  return 0;
+}
+
+int http_conn_sendv(struct http_conn *c, struct iovec *iov, int n,
+                    int64_t deadline) {
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+
+  while (msg.msg_iovlen) {
+    ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+      if (fdout(c->fd, deadline) < 0) return -1;
+      continue;
+    }
+
+    // skip what went out, which may end in the middle of a buffer
+    while (msg.msg_iovlen && (size_t)sent >= msg.msg_iov->iov_len) {
+      sent -= (ssize_t)msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+      msg.msg_iov->iov_len -= (size_t)sent;
+    }
+  }
+
+  return 0;
+}
+
+int http_conn_close(struct http_conn *c, int64_t deadline) {
+  if (shutdown(c->fd, SHUT_WR) < 0) return -1;
+
+  // discard whatever the peer still sends until it closes its side
+  char drain[512];
+  while (1) {
+    ssize_t n = recv_some(c->fd, drain, sizeof(drain), deadline);
+    if (n < 0) return -1;
+    if (n == 0) break;
+  }
+
+  http_conn_abort(c);
+  return 0;
+}
+
+void http_conn_abort(struct http_conn *c) {
+  // libdill keeps state for the descriptors it has waited on
+  fdclean(c->fd);
+  close(c->fd);
+}
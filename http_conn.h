@@ -0,0 +1,65 @@
+#ifndef HTTP_CONN_H
+#define HTTP_CONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// A raw non-blocking socket read through a buffer, waiting in libdill when
+// it runs dry. Request heads are parsed in place in the buffer, and whatever
+// arrived after a head (a body, pipelined requests) is kept for the next
+// read.
+struct http_conn {
+  int fd;
+  char *buf;
+  size_t size;
+  // the bytes received but not consumed yet are buf[start, end)
+  size_t start;
+  size_t end;
+  // bytes from start on already searched for the end of a head
+  size_t scanned;
+};
+
+void http_conn_init(struct http_conn *c, int fd);
+
+// Gives the connection a buffer, only while it holds none or has nothing
+// buffered, so that idle connections need not keep one.
+void http_conn_set_buf(struct http_conn *c, char *buf, size_t size);
+
+// bytes received but not consumed yet
+static inline size_t http_conn_pending(const struct http_conn *c) {
+  return c->end - c->start;
+}
+
+// Waits for a complete request head, which then starts at http_conn_data()
+// for http_parse_request(). Returns its length, to be consumed with
+// http_conn_consume() before reading the body, or -1 with errno set to EPIPE
+// if the peer closed the connection before sending anything, ECONNRESET if
+// it did so in the middle of a head, EMSGSIZE if the head doesn't fit into
+// the buffer or whatever fdin() reported.
+long http_conn_recv_head(struct http_conn *c, int64_t deadline);
+
+// the bytes received but not consumed yet, valid until the next read
+static inline const char *http_conn_data(const struct http_conn *c) {
+  return c->buf + c->start;
+}
+
+void http_conn_consume(struct http_conn *c, size_t n);
+
+// Receives exactly len bytes like brecv, the buffered ones first. Has the
+// signature of http_body_source.recv, with the http_conn as the argument.
+int http_conn_recv(void *conn, void *buf, size_t len, int64_t deadline);
+
+// sends all of the n buffers in iov, which it modifies
+int http_conn_sendv(struct http_conn *c, struct iovec *iov, int n,
+                    int64_t deadline);
+
+// Shuts the sending side down and closes the connection once the peer has
+// done the same, like tcp_close(), so that a response isn't cut short by a
+// reset. Returns -1 if the peer failed to, leaving the connection open.
+int http_conn_close(struct http_conn *c, int64_t deadline);
+
+// closes the connection straight away
+void http_conn_abort(struct http_conn *c);
+
+#endif
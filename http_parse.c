@@ -0,0 +1,184 @@
+#include "http_parse.h"
+
+#include <errno.h>
+
+#if (defined __x86_64__ || defined __i386__) && defined __SSE2__ && \
+    !defined HTTP_PARSE_NO_SIMD
+#define HTTP_PARSE_X86
+#include <immintrin.h>
+#endif
+
+static const char *scan_scalar(const char *p, const char *end, char a,
+                               char b) {
+  while (p < end && *p != a && *p != b) ++p;
+  return p;
+}
+
+#ifdef HTTP_PARSE_X86
+static const char *scan_sse2(const char *p, const char *end, char a, char b) {
+  const __m128i va = _mm_set1_epi8(a);
+  const __m128i vb = _mm_set1_epi8(b);
+
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+
+  return scan_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2"))) static const char *scan_avx2(const char *p,
+                                                             const char *end,
+                                                             char a, char b) {
+  const __m256i va = _mm256_set1_epi8(a);
+  const __m256i vb = _mm256_set1_epi8(b);
+
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+
+  return scan_sse2(p, end, a, b);
+}
+#endif
+
+const char *http_scan(const char *p, const char *end, char a, char b) {
+#ifdef HTTP_PARSE_X86
+  // most lines are shorter than a single AVX2 vector
+  if (end - p >= 32 && __builtin_cpu_supports("avx2"))
+    return scan_avx2(p, end, a, b);
+  return scan_sse2(p, end, a, b);
+#else
+  return scan_scalar(p, end, a, b);
+#endif
+}
+
+size_t http_head_end(const char *buf, size_t len, size_t *scanned) {
+  const char *end = buf + len;
+  const char *p = buf + *scanned;
+
+  while ((p = http_scan(p, end, '\n', '\n')) < end) {
+    // the line after this one is empty if it's a bare LF or CRLF
+    if (p + 1 < end && p[1] == '\n') return (size_t)(p + 2 - buf);
+    if (p + 2 < end && p[1] == '\r' && p[2] == '\n')
+      return (size_t)(p + 3 - buf);
+    if (p + 2 >= end) break;
+    ++p;
+  }
+
+  // look at the last line feed again once more has arrived
+  *scanned = (size_t)(p - buf);
+  return 0;
+}
+
+// the end of the line starting at p, without its CR, and in *next the start
+// of the line after it
+static const char *line_end(const char *p, const char *end,
+                            const char **next) {
+  const char *lf = http_scan(p, end, '\n', '\n');
+  *next = lf < end ? lf + 1 : end;
+  return lf > p && lf[-1] == '\r' ? lf - 1 : lf;
+}
+
+static struct http_slice slice(const char *from, const char *to) {
+  return (struct http_slice){from, (size_t)(to - from)};
+}
+
+static int fail(int err) {
+  errno = err;
+  return -1;
+}
+
+int http_parse_request(const char *buf, size_t len, struct http_request *req) {
+  const char *end = buf + len;
+  const char *p = buf;
+  const char *next;
+
+  // empty lines ahead of the request line are to be ignored
+  while (p < end && (*p == '\r' || *p == '\n')) ++p;
+
+  // method SP request-target SP HTTP-version
+  const char *eol = line_end(p, end, &next);
+  const char *sp1 = http_scan(p, eol, ' ', ' ');
+  if (sp1 == p || sp1 == eol) return fail(EPROTO);
+  const char *sp2 = http_scan(sp1 + 1, eol, ' ', ' ');
+  if (sp2 == sp1 + 1 || sp2 == eol) return fail(EPROTO);
+
+  req->method = slice(p, sp1);
+  req->target = slice(sp1 + 1, sp2);
+  req->version = slice(sp2 + 1, eol);
+  if (req->version.len < 5 || memcmp(req->version.ptr, "HTTP/", 5) != 0)
+    return fail(EPROTO);
+
+  req->n_headers = 0;
+  memset(req->known, -1, sizeof(req->known));
+
+  for (p = next; p < end; p = next) {
+    eol = line_end(p, end, &next);
+    if (eol == p) return 0;
+
+    // field-name ":" OWS field-value OWS, without obsolete line folding
+    const char *colon = http_scan(p, eol, ':', ' ');
+    if (colon == p || colon == eol || *colon != ':' || *p == '\t')
+      return fail(EPROTO);
+
+    const char *value = colon + 1;
+    while (value < eol && (*value == ' ' || *value == '\t')) ++value;
+    const char *value_end = eol;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+      --value_end;
+
+    if (req->n_headers == HTTP_MAX_HEADERS) return fail(E2BIG);
+    struct http_header *h = &req->headers[req->n_headers];
+    h->name = slice(p, colon);
+    h->value = slice(value, value_end);
+    h->id = http_header_lookup(h->name.ptr, h->name.len);
+    if (h->id != HTTP_HDR_OTHER) req->known[h->id] = (int8_t)req->n_headers;
+    req->n_headers++;
+  }
+
+  // http_head_end() didn't find the end of this one
+  return fail(EPROTO);
+}
+
+#define HTTP_MATCH(str, id) \
+  if (strncasecmp(name, str, len) == 0) return id
+
+enum http_header_id http_header_lookup(const char *name, size_t len) {
+  // the length leaves at most two candidates to compare with
+  switch (len) {
+    case 4:
+      HTTP_MATCH("Host", HTTP_HDR_HOST);
+      break;
+    case 5:
+      HTTP_MATCH("Range", HTTP_HDR_RANGE);
+      break;
+    case 6:
+      HTTP_MATCH("Accept", HTTP_HDR_ACCEPT);
+      HTTP_MATCH("Expect", HTTP_HDR_EXPECT);
+      break;
+    case 10:
+      HTTP_MATCH("Connection", HTTP_HDR_CONNECTION);
+      HTTP_MATCH("User-Agent", HTTP_HDR_USER_AGENT);
+      break;
+    case 12:
+      HTTP_MATCH("Content-Type", HTTP_HDR_CONTENT_TYPE);
+      break;
+    case 14:
+      HTTP_MATCH("Content-Length", HTTP_HDR_CONTENT_LENGTH);
+      break;
+    case 15:
+      HTTP_MATCH("Accept-Encoding", HTTP_HDR_ACCEPT_ENCODING);
+      break;
+    case 17:
+      HTTP_MATCH("Transfer-Encoding", HTTP_HDR_TRANSFER_ENCODING);
+      HTTP_MATCH("If-Modified-Since", HTTP_HDR_IF_MODIFIED_SINCE);
+      break;
+  }
+
+  return HTTP_HDR_OTHER;
+}
@@ -0,0 +1,89 @@
+#ifndef HTTP_PARSE_H
+#define HTTP_PARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+// most header fields a request may have
+#define HTTP_MAX_HEADERS 64
+
+// a piece of the buffer a request was parsed from, not NUL terminated
+struct http_slice {
+  const char *ptr;
+  size_t len;
+};
+
+// header fields the server looks at, resolved once while parsing
+enum http_header_id {
+  HTTP_HDR_OTHER,
+  HTTP_HDR_ACCEPT,
+  HTTP_HDR_ACCEPT_ENCODING,
+  HTTP_HDR_CONNECTION,
+  HTTP_HDR_CONTENT_LENGTH,
+  HTTP_HDR_CONTENT_TYPE,
+  HTTP_HDR_EXPECT,
+  HTTP_HDR_HOST,
+  HTTP_HDR_IF_MODIFIED_SINCE,
+  HTTP_HDR_RANGE,
+  HTTP_HDR_TRANSFER_ENCODING,
+  HTTP_HDR_USER_AGENT,
+  HTTP_HDR_COUNT,
+};
+
+struct http_header {
+  struct http_slice name;
+  // without the leading and trailing whitespace
+  struct http_slice value;
+  enum http_header_id id;
+};
+
+// A request head parsed in place: all slices point into the parsed buffer,
+// so they are only valid for as long as it is left alone.
+struct http_request {
+  struct http_slice method;
+  struct http_slice target;
+  struct http_slice version;
+  struct http_header headers[HTTP_MAX_HEADERS];
+  int n_headers;
+  // index in headers of the last field of each known kind, -1 if absent
+  int8_t known[HTTP_HDR_COUNT];
+};
+
+// Returns the first of the bytes a or b in [p, end), or end. Scans 32 or 16
+// bytes at a time with AVX2 or SSE2 where the cpu has them, unless built
+// with HTTP_PARSE_NO_SIMD.
+const char *http_scan(const char *p, const char *end, char a, char b);
+
+// Looks for the empty line ending a request head in buf[0, len), skipping
+// the first *scanned bytes which an earlier call has been through already.
+// Returns the length of the head including the empty line, or 0 and updates
+// *scanned if it isn't complete yet.
+size_t http_head_end(const char *buf, size_t len, size_t *scanned);
+
+// Parses a complete head of len bytes as found by http_head_end(). Returns
+// 0, or -1 with errno set to EPROTO if it is malformed or E2BIG if it has
+// more than HTTP_MAX_HEADERS fields.
+int http_parse_request(const char *buf, size_t len, struct http_request *req);
+
+// the kind of a header field by its name, matched case-insensitively
+enum http_header_id http_header_lookup(const char *name, size_t len);
+
+// the value of the last field of a known kind, NULL if there isn't one
+static inline const struct http_slice *http_request_field(
+    const struct http_request *req, enum http_header_id id) {
+  int i = req->known[id];
+  return i < 0 ? NULL : &req->headers[i].value;
+}
+
+static inline bool http_slice_eq(struct http_slice s, const char *str) {
+  return s.len == strlen(str) && memcmp(s.ptr, str, s.len) == 0;
+}
+
+static inline bool http_slice_caseeq(struct http_slice s, const char *str) {
+  return s.len == strlen(str) && strncasecmp(s.ptr, str, s.len) == 0;
+}
+
+#endif
@@ -0,0 +1,209 @@
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache_line.h"
+
+// a message including its level tag and newline
+#define LOG_LINE_SZ 256u
+// slots per ring, a power of two
+#define LOG_RING_SLOTS 1024u
+// bytes written by the flusher in one go
+#define LOG_BATCH_SZ 65536u
+// how long the flusher sleeps after finding the rings empty
+#define LOG_FLUSH_MS 20
+
+struct log_record {
+  uint32_t len;
+  char text[LOG_LINE_SZ - sizeof(uint32_t)];
+};
+
+// Single producer (the owning thread), single consumer (the flusher) ring.
+// The indices live on separate cache lines so that logging doesn't bounce
+// the producer's line between cores.
+struct log_ring {
+  _Alignas(RPA_CACHE_LINE) atomic_uint head;
+  _Alignas(RPA_CACHE_LINE) atomic_uint tail;
+  atomic_ulong dropped;
+  struct log_record records[LOG_RING_SLOTS];
+};
+
+static struct log_ring *rings;
+static int n_rings;
+static enum log_level max_level = LEVEL_INFO;
+static unsigned sample_every;
+static atomic_bool stopping;
+static pthread_t flusher;
+// where the flusher gathers records for a write, only it touches the contents
+static char *batch;
+
+static __thread struct log_ring *ring;
+static __thread unsigned sample_count;
+
+static const char tags[] = {'E', 'W', 'I', 'D'};
+
+static void write_all(const char *buf, size_t len) {
+  while (len) {
+    ssize_t rc = write(STDOUT_FILENO, buf, len);
+    if (rc < 0) return;
+    buf += rc;
+    len -= (size_t)rc;
+  }
+}
+
+// moves whatever the rings hold to stdout, returns the number of records
+static size_t flush_rings(char *batch) {
+  size_t used = 0;
+  size_t records = 0;
+
+  for (int i = 0; i < n_rings; ++i) {
+    struct log_ring *r = &rings[i];
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    for (; head != tail; ++head, ++records) {
+      struct log_record *rec = &r->records[head & (LOG_RING_SLOTS - 1)];
+      if (used + rec->len > LOG_BATCH_SZ) {
+        write_all(batch, used);
+        used = 0;
+      }
+      memcpy(batch + used, rec->text, rec->len);
+      used += rec->len;
+    }
+
+    atomic_store_explicit(&r->head, head, memory_order_release);
+  }
+
+  if (used) write_all(batch, used);
+
+  return records;
+}
+
+static void *flush_loop(void *arg) {
+  (void)arg;
+  struct timespec pause = {0, LOG_FLUSH_MS * 1000000L};
+
+  while (!atomic_load(&stopping)) {
+    if (!flush_rings(batch)) nanosleep(&pause, NULL);
+  }
+  flush_rings(batch);
+
+  return NULL;
+}
+
+int log_init(int count, enum log_level level, unsigned sample) {
+  rings = aligned_alloc(RPA_CACHE_LINE, count * sizeof(struct log_ring));
+  batch = malloc(LOG_BATCH_SZ);
+  if (!rings || !batch) goto fail;
+
+  for (int i = 0; i < count; ++i) {
+    atomic_init(&rings[i].head, 0);
+    atomic_init(&rings[i].tail, 0);
+    atomic_init(&rings[i].dropped, 0);
+  }
+
+  n_rings = count;
+  max_level = level;
+  sample_every = sample;
+  atomic_init(&stopping, false);
+
+  int rc = pthread_create(&flusher, NULL, flush_loop, NULL);
+  if (rc != 0) {
+    errno = rc;
+    goto fail;
+  }
+
+  return 0;
+
+fail:;
+  int err = errno;
+  free(rings);
+  free(batch);
+  rings = NULL;
+  batch = NULL;
+  n_rings = 0;
+  errno = err;
+  return -1;
+}
+
+void log_shutdown(void) {
+  if (!rings) return;
+
+  atomic_store(&stopping, true);
+  pthread_join(flusher, NULL);
+
+  for (int i = 0; i < n_rings; ++i) {
+    unsigned long dropped = atomic_load(&rings[i].dropped);
+    if (dropped)
+      fprintf(stderr, "log ring %d dropped %lu messages\n", i, dropped);
+  }
+
+  free(rings);
+  free(batch);
+  rings = NULL;
+  batch = NULL;
+  n_rings = 0;
+}
+
+void log_attach(int index) {
+  ring = index >= 0 && index < n_rings ? &rings[index] : NULL;
+}
+
+bool log_enabled(enum log_level level) { return level <= max_level; }
+
+bool log_sample(void) {
+  if (!sample_every || max_level < LEVEL_INFO) return false;
+  if (++sample_count < sample_every) return false;
+  sample_count = 0;
+  return true;
+}
+
+// formats "[T] message\n" into buf, truncating the message to fit
+static uint32_t format(char *buf, size_t len, enum log_level level,
+                       const char *fmt, va_list ap) {
+  int n = snprintf(buf, len, "[%c] ", tags[level]);
+  int m = vsnprintf(buf + n, len - n - 1, fmt, ap);
+  if (m < 0) m = 0;
+  if ((size_t)(n + m) > len - 2) m = (int)len - 2 - n;
+
+  buf[n + m] = '\n';
+  return (uint32_t)(n + m + 1);
+}
+
+void log_write(enum log_level level, const char *fmt, ...) {
+  if (level > max_level) return;
+
+  va_list ap;
+  va_start(ap, fmt);
+
+  if (!ring) {
+    char line[LOG_LINE_SZ];
+    write_all(line, format(line, sizeof(line), level, fmt, ap));
+    va_end(ap);
+    return;
+  }
+
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  if (tail - head == LOG_RING_SLOTS) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    va_end(ap);
+    return;
+  }
+
+  struct log_record *rec = &ring->records[tail & (LOG_RING_SLOTS - 1)];
+  rec->len = format(rec->text, sizeof(rec->text), level, fmt, ap);
+  va_end(ap);
+
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
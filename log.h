@@ -0,0 +1,37 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+
+enum log_level {
+  LEVEL_ERROR,
+  LEVEL_WARN,
+  LEVEL_INFO,
+  LEVEL_DEBUG,
+};
+
+// Sets up one ring per logging thread and starts the flusher thread, which
+// writes the rings to stdout in batches. Messages above level are discarded
+// and one in every sample calls to log_sample() succeeds (0 = never).
+int log_init(int rings, enum log_level level, unsigned sample);
+
+// flushes what is left in the rings and stops the flusher thread
+void log_shutdown(void);
+
+// makes the calling thread log through the given ring, threads which aren't
+// attached to one write synchronously
+void log_attach(int ring);
+
+// whether messages of the level are written at all
+bool log_enabled(enum log_level level);
+
+// whether the calling thread should log the current request to the access log
+bool log_sample(void);
+
+// Formats a message into the calling thread's ring. Never blocks: the message
+// is dropped (and counted) if the ring is full, and truncated if it is longer
+// than a ring slot.
+void log_write(enum log_level level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -1,14 +1,25 @@
+#if defined __linux__
+// for accept4()
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <libdill.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -19,17 +30,258 @@
 #include <sys/sysinfo.h>
 #endif
 
+#include "affinity.h"
+#include "buf_pool.h"
+#include "http_body.h"
+#include "http_conn.h"
+#include "http_parse.h"
+#include "log.h"
+#include "metrics.h"
+#include "resp_cache.h"
 #include "rpa_queue.h"
+#include "stack_pool.h"
+#include "static_files.h"
 
-#define TIMEOUT -1
-#define MESSAGE_BUF_SZ 1024u
+#define MESSAGE_BUF_SZ 16384u
 #define QUEUE_CAPACITY 64u
+#define DISPATCH_BATCH 16u
+// bytes of free request buffers each slave keeps per size class
+#define POOL_CLASS_BUDGET (4u << 20)
+// a sibling's queue must hold this many sockets before any are stolen
+#define STEAL_MIN_QUEUED 2u
+// the descriptor of the message pushed to a slave's queue to make it exit
+#define SHUTDOWN_FD -1
+// one acceptor pushes to each queue and one slave pops from it
+#define QUEUE_FLAGS (RPA_QUEUE_POLLABLE | RPA_QUEUE_SPSC)
+// written to connections that are shed with the 503 policy
+#define SHED_RESPONSE                                                     \
+  "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"           \
+  "Connection: close\r\nRetry-After: 1\r\n\r\n"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
-volatile sig_atomic_t done;
+// most cpus --cpus can list
+#define MAX_CPUS 1024
+// most subnets --critical-net can be given
+#define MAX_CRITICAL_NETS 16
+
+// reserved for the server's own metrics, answered by every worker
+#define METRICS_PATH "/metrics"
+#define METRICS_BUF_SZ 65536u
+
+// open files cached per slave, each holding at most one descriptor
+#define FILE_CACHE_SLOTS 256u
+// largest file kept in the response cache
+#define RESP_CACHE_MAX_BODY (256u << 10)
+// longest response cache key, longer requests aren't cached
+#define RESP_CACHE_KEY_SZ 1024u
+
+// workers a slave runs at once unless told otherwise
+#define MAX_COROUTINES 1024u
+// a worker's stack, deep enough for a file request and an error path's
+// logging on top of it
+#define STACK_SIZE (64u << 10)
+#define MIN_STACK_SIZE (16u << 10)
+
+enum dispatch_mode {
+  // one thread accepts and hands sockets to the slaves through queues
+  MODE_QUEUE,
+  // every slave accepts on its own SO_REUSEPORT listener
+  MODE_REUSEPORT,
+};
+
+// what is done with connections no slave has room for
+enum shed_policy {
+  // a minimal 503 written straight from the acceptor, then close
+  SHED_503,
+  SHED_CLOSE,
+};
+
+// priority classes of the slaves' queues, most urgent first
+enum conn_class {
+  // health checks and control traffic, see --critical-port/--critical-net
+  CLASS_CRITICAL,
+  CLASS_BULK,
+  N_CLASSES,
+};
+
+// an IPv4 subnet, both in network byte order
+struct subnet {
+  uint32_t addr;
+  uint32_t mask;
+};
+
+// how requests are read off connections
+enum parser {
+  // parsed in place in a buffer of our own, off the raw socket
+  PARSER_BUFFERED,
+  // libdill's line by line HTTP protocol
+  PARSER_LIBDILL,
+};
+
+enum dispatch_policy {
+  POLICY_ROUND_ROBIN,
+  // the slave with the fewest active plus queued connections
+  POLICY_LEAST_LOADED,
+  // the less loaded of two randomly chosen slaves
+  POLICY_TWO_CHOICES,
+};
+
+static struct {
+  int port;
+  int backlog;
+  // slave threads, 0 = one for every cpu but the one accepting
+  int threads;
+  enum dispatch_mode mode;
+  enum dispatch_policy policy;
+  enum parser parser;
+  // how often an idle slave looks for work in its siblings' queues, 0 = never
+  int steal_ms;
+  // how long a connection may wait for its next request, -1 = forever
+  int keepalive_ms;
+  // how long a request head may take, from the first byte of the first
+  // request and from whichever comes first of the later ones, -1 = forever
+  int header_timeout_ms;
+  // how long a request body may take on top of what body_rate allows
+  int body_timeout_ms;
+  // bytes per second request bodies have to arrive at, 0 = any
+  unsigned long body_rate;
+  // how long a client may take to accept a response, -1 = forever
+  int send_timeout_ms;
+  // requests served over one connection before it is closed
+  int max_requests;
+  // largest request body accepted, larger ones are refused with a 413
+  unsigned long max_body;
+  enum log_level log_level;
+  // one in how many requests makes it to the access log, 0 = none
+  unsigned access_sample;
+  // have the queues count their traffic and waits for /metrics
+  bool queue_stats;
+  uint32_t queue_capacity;
+  // how long the acceptor waits for a full queue before spilling over
+  int push_wait_ms;
+  // active plus queued connections a slave may have, 0 = no limit
+  uint32_t max_conns;
+  // workers a slave runs at once, its other connections stay queued
+  uint32_t max_coroutines;
+  // bytes of every worker's stack
+  size_t stack_size;
+  enum shed_policy shed;
+  // cpus to pin the acceptor (first) and the slaves to, in turn
+  int cpus[MAX_CPUS];
+  int n_cpus;
+  // used to pick the cpus when none are listed
+  enum placement placement;
+  // connections to this port, or from these subnets, are queued ahead of the
+  // rest; 0 and none respectively disable the classes
+  int critical_port;
+  struct subnet critical_nets[MAX_CRITICAL_NETS];
+  int n_critical_nets;
+  // critical connections dequeued for every bulk one, 0 = always first
+  uint32_t critical_weight;
+  // directory to serve files from, NULL = none
+  const char *root;
+  // memory for cached responses to file requests, 0 = no cache
+  size_t cache_size;
+  // how long a response stays cached
+  int cache_ttl_ms;
+} config = {
+    .port = 1234,
+    .backlog = SOMAXCONN,
+    .mode = MODE_QUEUE,
+    .policy = POLICY_ROUND_ROBIN,
+    .keepalive_ms = 5000,
+    .header_timeout_ms = 10000,
+    .body_timeout_ms = 10000,
+    .body_rate = 1024,
+    .send_timeout_ms = 10000,
+    .max_requests = 100,
+    .max_body = 1u << 20,
+    .log_level = LEVEL_INFO,
+    .access_sample = 1,
+    .queue_capacity = QUEUE_CAPACITY,
+    .shed = SHED_503,
+    .max_coroutines = MAX_COROUTINES,
+    .stack_size = STACK_SIZE,
+    .cache_ttl_ms = 1000,
+};
+
+// an accepted connection on its way from the dispatcher to a slave, copied
+// through the queue by value
+struct conn_msg {
+  int fd;
+  // metrics_now_us() at accept time
+  uint64_t accepted_us;
+};
+
+RPA_QUEUE_DEFINE_TYPED(conn, struct conn_msg)
+
+static const struct conn_msg shutdown_msg = {.fd = SHUTDOWN_FD};
+
+// a worker coroutine and the stack it runs on
+struct worker_slot {
+  // -1 if the slot is free or being closed
+  int cr;
+  void *stack;
+};
+
+// The workers a slave runs, in --max-coroutines slots. A worker that's done
+// only adds its slot to the done list; the slave closes its handle, and only
+// then is its stack no longer in use and put back. Owned by the thread.
+struct workers {
+  struct worker_slot *slots;
+  // indices of the free slots
+  uint32_t *free;
+  uint32_t n_free;
+  // indices of the slots whose worker finished, yet to be closed
+  uint32_t *done;
+  uint32_t n_done;
+  struct stack_pool stacks;
+};
+
+// per slave thread state, aligned so that slaves don't share cache lines
+struct slave_ctx {
+  // worker coroutines running on the thread, read by the dispatcher
+  _Alignas(RPA_CACHE_LINE) atomic_uint active;
+  int id;
+  rpa_queue_t *queue;
+  pthread_t thread;
+  // request buffers, only ever touched by this slave's thread
+  struct buf_pool pool;
+  // open files under --root, NULL if there isn't one
+  struct static_cache *files;
+  // created by the thread
+  struct workers workers;
+  // a worker that finishes while the slave waits for room wakes it up here
+  int room[2];
+  bool waiting_for_room;
+  // set once shutdown began, from then on connections are closed unserved
+  bool stopping;
+  // all of the slaves, including this one
+  struct slave_ctx *siblings;
+  int n_siblings;
+  // the cpu the thread is pinned to, -1 if it isn't
+  int cpu;
+};
+
+// shared by all slaves, NULL without --cache-size
+static struct resp_cache *resp_cache;
+
+// the slave_ctx of the calling thread
+static __thread struct slave_ctx *self;
+
+// becomes (and stays) readable once SIGINT arrives, so any thread can fdin()
+// on the read end to learn about shutdown
+static int shutdown_pipe[2];
 
 static void sig_handler(int sig, siginfo_t *siginfo, void *context) {
   if (sig == SIGINT) {
-    done = 1;
+    int err = errno;
+    ssize_t rc = write(shutdown_pipe[1], "", 1);
+    (void)rc;
+    errno = err;
   }
 }
 
@@ -41,7 +293,13 @@ static int set_sig_handler() {
   act.sa_sigaction = &sig_handler;
   act.sa_flags = SA_SIGINFO | SA_RESTART;
 
-  return sigaction(SIGINT, &act, NULL);
+  if (sigaction(SIGINT, &act, NULL) < 0) return -1;
+
+  // sendfile() has no MSG_NOSIGNAL, clients going away mustn't kill us
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = SIG_IGN;
+
+  return sigaction(SIGPIPE, &act, NULL);
 }
 
 static int block_signal(int sig) {
@@ -64,6 +322,73 @@ static void unblock(int s) {
   assert(rc == 0);
 }
 
+static int open_listener(int port, bool reuseport) {
+  struct sockaddr_in serv_addr;
+
+  // create the socket
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("Failed to open socket");
+    return -1;
+  }
+
+  unblock(fd);
+
+  if (reuseport) {
+    int opt = 1;
+    int rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    if (rc < 0) {
+      perror("Failed to set SO_REUSEPORT");
+      close(fd);
+      return -1;
+    }
+  }
+
+  bzero((char *)&serv_addr, sizeof(serv_addr));
+
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_addr.s_addr = INADDR_ANY;
+  serv_addr.sin_port = htons(port);
+
+  // bind the socket
+  int rc = bind(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+  if (rc < 0) {
+    perror("Failed to bind socket");
+    close(fd);
+    return -1;
+  }
+
+  // listen for connections
+  rc = listen(fd, config.backlog);
+  if (rc < 0) {
+    perror("Failed to listen on socket");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// accepts a pending connection as a non-blocking, close-on-exec socket,
+// storing the peer's address in peer unless it is NULL
+static int accept_nb(int fd, struct sockaddr_in *peer) {
+  socklen_t len = sizeof(*peer);
+#if defined __linux__
+  return accept4(fd, (struct sockaddr *)peer, peer ? &len : NULL,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int s = accept(fd, (struct sockaddr *)peer, peer ? &len : NULL);
+  if (s < 0) return s;
+
+  int opt = fcntl(s, F_GETFL, 0);
+  if (opt == -1) opt = 0;
+  fcntl(s, F_SETFL, opt | O_NONBLOCK);
+  fcntl(s, F_SETFD, FD_CLOEXEC);
+
+  return s;
+#endif
+}
+
 static int cpu_num() {
 #if defined __APPLE__ || __OpenBSD__ || __FreeBSD__ || __DragonFly__
   int mib[4];
@@ -87,125 +412,1690 @@ static int cpu_num() {
 #endif
 }
 
-static coroutine void worker(int s) {
-  s = http_attach(s);
-  if (s < 0) goto cleanup;
+// a deadline ms milliseconds from now, -1 (none) if ms is negative
+static int64_t deadline_in(int ms) {
+  return ms >= 0 ? now() + ms : -1;
+}
 
-  int rc;
-  unsigned long content_length;
-  char name[256];
-  char value[256];
+static int log_body(void *arg, const char *data, size_t len) {
+  log_write(LEVEL_DEBUG, "body: %.*s", (int)len, data);
+  return 0;
+}
 
-  http_recvrequest(s, name, sizeof(name), value, sizeof(value), -1);
+// what is done with request bodies as they arrive
+static const struct http_body_handler body_handler = {
+    .on_data = log_body,
+    .on_end = NULL,
+    .arg = NULL,
+};
+
+// streams a request body through body_handler, off the buffered connection
+// c or else the raw TCP socket s, returns its size
+static long recv_body(struct http_conn *c, int s,
+                      const struct http_body *body) {
+  char *buf = buf_pool_get(&self->pool, MESSAGE_BUF_SZ);
+  if (!buf) return -1;
+
+  int64_t deadline = deadline_in(config.body_timeout_ms);
+  long rc;
+  if (c) {
+    struct http_body_source src = {.recv = http_conn_recv, .arg = c};
+    rc = http_body_recv_from(&src, body, buf, MESSAGE_BUF_SZ, &body_handler,
+                             deadline);
+  } else {
+    rc = http_body_recv(s, body, buf, MESSAGE_BUF_SZ, &body_handler,
+                        deadline);
+  }
 
-  printf("=====\n");
-  printf("%s %s\n=====\n", name, value);
+  buf_pool_put(&self->pool, buf);
+  return rc;
+}
 
-  int is_post = !strncmp(name, "POST", 4);
+// sends a header field, adding its size on the wire to *bytes
+static int send_field(int s, const char *name, const char *value,
+                      uint64_t *bytes, int64_t deadline) {
+  int rc = http_sendfield(s, name, value, deadline);
+  if (rc == 0) *bytes += strlen(name) + strlen(value) + 4;
+  return rc;
+}
 
-  while (1) {
-    int rc =
-        http_recvfield(s, name, sizeof(name), value, sizeof(value), TIMEOUT);
-    if (rc == -1) {
-      if (errno == EPIPE)
-        break;
-      else if (errno == ECANCELED)
-        goto cleanup;
+// renders the counters of the slaves' queues, if they keep any
+static size_t render_queue_stats(char *buf, size_t len) {
+  if (!config.queue_stats || !self->siblings[0].queue) return 0;
+
+  rpa_queue_stats_t *stats = malloc(self->n_siblings * sizeof(*stats));
+  if (!stats) return 0;
+
+  for (int i = 0; i < self->n_siblings; ++i)
+    rpa_queue_stats(self->siblings[i].queue, &stats[i]);
+
+  size_t n = metrics_render_queues(buf, len, stats, self->n_siblings);
+  free(stats);
+  return n;
+}
+
+// whether chunked is the final coding of a Transfer-Encoding value
+static bool is_chunked(struct http_slice value) {
+  const char *end = value.ptr + value.len;
+  const char *coding = end;
+  while (coding > value.ptr && coding[-1] != ',') --coding;
+
+  while (coding < end && (*coding == ' ' || *coding == '\t')) ++coding;
+  while (end > coding && (end[-1] == ' ' || end[-1] == '\t')) --end;
+  return http_slice_caseeq((struct http_slice){coding, (size_t)(end - coding)},
+                           "chunked");
+}
+
+// Parses a Content-Length value into *n, returns -1 unless it's all digits.
+// Values too large for *n come out as ULONG_MAX, which is over any limit.
+static int parse_length(struct http_slice value, unsigned long *n) {
+  if (!value.len) return -1;
+
+  *n = 0;
+  for (size_t i = 0; i < value.len; ++i) {
+    unsigned digit = (unsigned char)value.ptr[i] - '0';
+    if (digit > 9) return -1;
+    if (*n > (ULONG_MAX - digit) / 10)
+      *n = ULONG_MAX;
+    else if (*n != ULONG_MAX)
+      *n = *n * 10 + digit;
+  }
+  return 0;
+}
+
+// a request and its response, whichever parser read it
+struct exchange {
+  struct http_body body;
+  bool has_encoding;
+  bool has_length;
+  // a Content-Length that doesn't parse or disagrees with an earlier one,
+  // which leaves the body's framing unknown
+  bool bad_length;
+  bool keep_alive;
+  int status;
+  const char *reason;
+  // the request body is left unread, which rules out reusing the connection
+  bool skip_body;
+  // a HEAD request, answered with everything but the body
+  bool no_body;
+  // the rendered metrics while they're being sent
+  char *page;
+  size_t page_len;
+  // the file served and the part of it to send
+  struct static_file *file;
+  off_t file_offset;
+  off_t file_len;
+  // header fields besides Connection for render_head(), each ending in CRLF
+  char fields[256];
+  size_t fields_len;
+  uint64_t start;
+  // sizes on the wire, give or take the protocol version and separators
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+};
+
+static void exchange_init(struct exchange *x) {
+  *x = (struct exchange){
+      .body = {.limit = config.max_body, .min_rate = config.body_rate},
+      // persistent by default in HTTP/1.1, the only version libdill's parser
+      // accepts; the buffered one corrects this for other versions
+      .keep_alive = true,
+      .start = metrics_now_us(),
+  };
+}
+
+// takes note of the header fields which matter to the response
+static void exchange_field(struct exchange *x, enum http_header_id id,
+                           struct http_slice value) {
+  switch (id) {
+    case HTTP_HDR_CONTENT_LENGTH: {
+      unsigned long n = ULONG_MAX;
+      if (parse_length(value, &n) < 0 ||
+          (x->has_length && n != x->body.length))
+        x->bad_length = true;
+      x->has_length = true;
+      x->body.length = n;
+      break;
     }
+    case HTTP_HDR_TRANSFER_ENCODING:
+      x->has_encoding = true;
+      x->body.chunked = is_chunked(value);
+      break;
+    case HTTP_HDR_CONNECTION:
+      if (http_slice_caseeq(value, "close"))
+        x->keep_alive = false;
+      else if (http_slice_caseeq(value, "keep-alive"))
+        x->keep_alive = true;
+      break;
+    default:
+      break;
+  }
+}
+
+// appends a header field to the response, dropped if it doesn't fit
+static void add_field(struct exchange *x, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  size_t room = sizeof(x->fields) - x->fields_len;
+  int n = vsnprintf(x->fields + x->fields_len, room, fmt, args);
+  va_end(args);
+
+  if (n >= 0 && (size_t)n < room)
+    x->fields_len += (size_t)n;
+  else
+    x->fields[x->fields_len] = '\0';
+}
+
+static void set_status(struct exchange *x, int status, const char *reason) {
+  x->status = status;
+  x->reason = reason;
+}
+
+// looks the target up under --root and picks the part of the file to send
+static void plan_file(struct exchange *x, struct http_slice target,
+                      const struct http_request *req) {
+  struct static_file *file = static_cache_get(self->files, target);
+  if (!file) {
+    if (errno == EACCES)
+      set_status(x, 403, "Forbidden");
+    else if (errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG ||
+             errno == ELOOP)
+      set_status(x, 404, "Not Found");
+    else
+      set_status(x, 500, "Internal Server Error");
+    return;
+  }
 
-    printf("%s: %s\n", name, value);
+  add_field(x, "Last-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+            file->last_modified);
 
-    if (strncmp(name, "Content-Length", 14) == 0) {
-      content_length = strtoul(value, NULL, 0);
+  const struct http_slice *since =
+      http_request_field(req, HTTP_HDR_IF_MODIFIED_SINCE);
+  if (since && static_not_modified(*since, file->mtime)) {
+    set_status(x, 304, "Not Modified");
+    static_file_put(file);
+    return;
+  }
+
+  off_t offset = 0;
+  off_t len = file->size;
+  const struct http_slice *range = http_request_field(req, HTTP_HDR_RANGE);
+  int rc = range ? static_parse_range(*range, file->size, &offset, &len) : 0;
+  if (rc < 0) {
+    set_status(x, 416, "Range Not Satisfiable");
+    add_field(x, "Content-Range: bytes */%lld\r\n", (long long)file->size);
+    static_file_put(file);
+    return;
+  }
+  if (rc > 0) {
+    set_status(x, 206, "Partial Content");
+    add_field(x, "Content-Range: bytes %lld-%lld/%lld\r\n",
+              (long long)offset, (long long)(offset + len - 1),
+              (long long)file->size);
+  }
+
+  add_field(x, "Content-Type: %s\r\n", file->content_type);
+  x->file = file;
+  x->file_offset = offset;
+  x->file_len = len;
+}
+
+// Decides on the response to the served-th request of a connection once its
+// head is in. Files are only served off the parsed head req, which libdill's
+// parser has none of.
+static void plan_response(struct exchange *x, struct http_slice method,
+                          struct http_slice target,
+                          const struct http_request *req, int served) {
+  if (served + 1 >= config.max_requests) x->keep_alive = false;
+
+  // The chunked coding takes precedence over Content-Length, but a message
+  // with both may have been framed differently on the way here, so nothing
+  // after it on the connection is trusted (RFC 9112, section 6.1).
+  if (x->body.chunked) x->body.length = 0;
+  if (x->has_encoding && x->has_length) x->keep_alive = false;
+
+  // refuse bodies which can't or shouldn't be read, which leaves the
+  // connection unusable for further requests
+  set_status(x, 200, "OK");
+  if (x->bad_length) {
+    set_status(x, 400, "Bad Request");
+    x->skip_body = true;
+  } else if (x->has_encoding && !x->body.chunked) {
+    set_status(x, 501, "Not Implemented");
+    x->skip_body = true;
+  } else if (x->body.length > config.max_body) {
+    set_status(x, 413, "Payload Too Large");
+    x->skip_body = true;
+  }
+  if (x->skip_body) x->keep_alive = false;
+
+  x->no_body = http_slice_eq(method, "HEAD");
+  bool get = x->no_body || http_slice_eq(method, "GET");
+
+  if (x->status == 200 && get && http_slice_eq(target, METRICS_PATH)) {
+    x->page = buf_pool_get(&self->pool, METRICS_BUF_SZ);
+    if (x->page) {
+      x->page_len = metrics_render(x->page, METRICS_BUF_SZ);
+      x->page_len += render_queue_stats(x->page + x->page_len,
+                                        METRICS_BUF_SZ - x->page_len);
+      add_field(x, "Content-Type: text/plain; version=0.0.4\r\n");
+    } else {
+      set_status(x, 503, "Service Unavailable");
     }
+  } else if (x->status == 200 && get && req && self->files) {
+    plan_file(x, target, req);
   }
 
-  printf("=====\n");
+  // delimits the response so that the connection can be reused
+  if (x->status != 304)
+    add_field(x, "Content-Length: %lld\r\n",
+              x->page ? (long long)x->page_len : (long long)x->file_len);
 
-  http_sendstatus(s, 200, "OK", TIMEOUT);
+  if (log_sample())
+    log_write(LEVEL_INFO, "%.*s %.*s %d", (int)method.len, method.ptr,
+              (int)target.len, target.ptr, x->status);
+}
 
-  s = http_detach(s, TIMEOUT);
-  if (s < 0) goto cleanup;
+// lets go of the metrics page or file once it has been sent
+static void release_body(struct exchange *x) {
+  if (x->page) buf_pool_put(&self->pool, x->page);
+  x->page = NULL;
+  if (x->file) static_file_put(x->file);
+  x->file = NULL;
+}
 
-  if (is_post && content_length) {
-    size_t data_sz = content_length * sizeof(char);
-    size_t n = data_sz / MESSAGE_BUF_SZ;
-    size_t l = data_sz % MESSAGE_BUF_SZ;
+static void finish_exchange(struct exchange *x, struct metrics *m) {
+  metrics_add(&m->requests, 1);
+  metrics_add(&m->bytes_in, x->bytes_in);
+  metrics_add(&m->bytes_out, x->bytes_out);
+  if (x->status >= 400) metrics_add(&m->errors, 1);
+  hist_record(&m->request_us, metrics_now_us() - x->start);
+}
 
-    char *data = malloc((content_length + 1) * sizeof(char));
+static struct http_slice cstr_slice(const char *str) {
+  return (struct http_slice){str, strlen(str)};
+}
+
+// serves requests off the connection until the client or the limits end
+// it, reading them through libdill's HTTP protocol
+static void serve_connection(int s) {
+  int rc;
+  char command[256];
+  char resource[256];
+  char name[256];
+  char value[256];
+  struct metrics *m = metrics_local();
+  struct exchange x = {0};
+  // what the connection is waiting for, which a timeout is put down to
+  enum metrics_phase phase = PHASE_HEADER;
+  int64_t deadline;
+
+  for (int served = 0;; ++served) {
+    // the first request has to come soon, later ones may never come
+    phase = served ? PHASE_IDLE : PHASE_HEADER;
+    deadline = deadline_in(served ? config.keepalive_ms
+                                  : config.header_timeout_ms);
+
+    int h = http_attach(s);
+    if (h < 0) goto cleanup;
+    s = h;
+
+    rc = http_recvrequest(s, command, sizeof(command), resource,
+                          sizeof(resource), deadline);
+    // the client went away or stayed idle for too long
+    if (rc < 0) {
+      if (errno == ETIMEDOUT) metrics_add(&m->timeouts[phase], 1);
+      goto cleanup;
+    }
 
-    for (size_t i = 0; i < n; ++i) {
-      rc = brecv(s, data + i * MESSAGE_BUF_SZ, MESSAGE_BUF_SZ, TIMEOUT);
+    exchange_init(&x);
+    x.bytes_in = strlen(command) + strlen(resource) + 12;
+
+    phase = PHASE_HEADER;
+    deadline = deadline_in(config.header_timeout_ms);
+    while (1) {
+      int rc =
+          http_recvfield(s, name, sizeof(name), value, sizeof(value), deadline);
       if (rc == -1) {
         if (errno == EPIPE)
           break;
-        else if (errno == ECANCELED)
-          goto cleanup;
+        else
+          goto fail;
       }
+      x.bytes_in += strlen(name) + strlen(value) + 4;
+
+      log_write(LEVEL_DEBUG, "%s: %s", name, value);
+
+      exchange_field(&x, http_header_lookup(name, strlen(name)),
+                     cstr_slice(value));
     }
 
-    if (l) {
-      rc = brecv(s, data + MESSAGE_BUF_SZ * n, l, TIMEOUT);
-      if (rc == -1 && errno == ECANCELED) goto cleanup;
+    x.bytes_in += 2;
+    hist_record(&m->parse_us, metrics_now_us() - x.start);
+
+    plan_response(&x, cstr_slice(command), cstr_slice(resource), NULL,
+                  served);
+
+    phase = PHASE_WRITE;
+    deadline = deadline_in(config.send_timeout_ms);
+    rc = http_sendstatus(s, x.status, x.reason, deadline);
+    if (rc < 0) goto fail;
+    x.bytes_out += strlen(x.reason) + 15;
+    // delimits the response so that the connection can be reused
+    char length[24];
+    snprintf(length, sizeof(length), "%zu", x.page_len);
+    rc = send_field(s, "Content-Length", length, &x.bytes_out, deadline);
+    if (rc < 0) goto fail;
+    if (x.page) {
+      rc = send_field(s, "Content-Type", "text/plain; version=0.0.4",
+                      &x.bytes_out, deadline);
+      if (rc < 0) goto fail;
+    }
+    rc = send_field(s, "Connection", x.keep_alive ? "keep-alive" : "close",
+                    &x.bytes_out, deadline);
+    if (rc < 0) goto fail;
+
+    // flushes the response head, the body follows on the raw socket
+    s = http_detach(s, deadline);
+    if (s < 0) {
+      metrics_add(&m->errors, 1);
+      goto release;
     }
+    x.bytes_out += 2;
 
-    data[data_sz] = '\0';
+    if (x.page && !x.no_body) {
+      rc = bsend(s, x.page, x.page_len, deadline);
+      if (rc < 0) goto fail;
+      x.bytes_out += x.page_len;
+    }
+    release_body(&x);
+
+    // consume the body so that the next request starts where it ends,
+    // chunked ones over the limit are cut off with the connection
+    if (!x.skip_body && (x.body.chunked || x.body.length)) {
+      phase = PHASE_BODY;
+      long n = recv_body(NULL, s, &x.body);
+      if (n < 0) goto fail;
+      x.bytes_in += n;
+    }
 
-    fprintf(stdout, "%s\n", data);
+    finish_exchange(&x, m);
+    if (!x.keep_alive) break;
   }
 
-  rc = tcp_close(s, TIMEOUT);
-  if (rc < 0)
-    goto cleanup;
-  else
-    return;
+  // waits for the client to close its side after taking the response
+  rc = tcp_close(s, deadline_in(config.send_timeout_ms));
+  if (rc == 0) return;
+  if (errno == ETIMEDOUT) metrics_add(&m->timeouts[PHASE_WRITE], 1);
+  goto cleanup;
 
+fail:
+  // the request was cut short
+  metrics_add(&m->errors, 1);
+  if (errno == ETIMEDOUT) metrics_add(&m->timeouts[phase], 1);
 cleanup:
   rc = hclose(s);
   assert(rc == 0);
+release:
+  release_body(&x);
+}
+
+// the status line and header fields of a response up to Connection, which
+// is all a cached response keeps of its head
+static size_t render_fields(char *buf, size_t len, const struct exchange *x) {
+  int n = snprintf(buf, len, "HTTP/1.1 %d %s\r\n%s", x->status, x->reason,
+                   x->fields);
+  return n < 0 || (size_t)n >= len ? 0 : (size_t)n;
+}
+
+static const char *connection_field(bool keep_alive) {
+  return keep_alive ? "Connection: keep-alive\r\n\r\n"
+                    : "Connection: close\r\n\r\n";
+}
+
+// the status line and header fields of a response, NUL terminated
+static size_t render_head(char *buf, size_t len, const struct exchange *x) {
+  size_t n = render_fields(buf, len, x);
+  const char *conn = connection_field(x->keep_alive);
+  size_t conn_len = strlen(conn);
+  if (!n || n + conn_len >= len) return 0;
+  memcpy(buf + n, conn, conn_len + 1);
+  return n + conn_len;
+}
+
+// the header fields a cached response may depend on besides the target
+static const enum http_header_id cache_key_fields[] = {HTTP_HDR_HOST};
+
+// Builds the response cache key of a request for a file into key, returns
+// its length or 0 if the response is not to be cached: conditional, ranged
+// and requests with a body are always answered afresh.
+static size_t cache_key(char *key, size_t len, const struct exchange *x,
+                        const struct http_request *req) {
+  if (!resp_cache || !self->files || x->has_encoding || x->body.length ||
+      http_request_field(req, HTTP_HDR_RANGE) ||
+      http_request_field(req, HTTP_HDR_IF_MODIFIED_SINCE) ||
+      http_slice_eq(req->target, METRICS_PATH) ||
+      !(http_slice_eq(req->method, "GET") ||
+        http_slice_eq(req->method, "HEAD")))
+    return 0;
+
+  // "method target" and then every key field's value, empty if it's
+  // missing, each NUL terminated. The method has no space and a part with a
+  // NUL of its own isn't cached, which keeps keys unambiguous.
+  if (memchr(req->target.ptr, '\0', req->target.len)) return 0;
+  int n = snprintf(key, len, "%.*s %.*s", (int)req->method.len,
+                   req->method.ptr, (int)req->target.len, req->target.ptr);
+  if (n < 0 || (size_t)n >= len) return 0;
+  size_t used = (size_t)n + 1;
+
+  for (size_t i = 0; i < sizeof(cache_key_fields) / sizeof(*cache_key_fields);
+       ++i) {
+    const struct http_slice *value =
+        http_request_field(req, cache_key_fields[i]);
+    size_t value_len = value ? value->len : 0;
+    if (used + value_len + 1 > len ||
+        (value_len && memchr(value->ptr, '\0', value_len)))
+      return 0;
+    if (value_len) memcpy(key + used, value->ptr, value_len);
+    used += value_len;
+    key[used++] = '\0';
+  }
+
+  return used;
+}
+
+// caches the response about to be sent for a file, if it is small enough
+static void cache_response(const struct exchange *x, const char *key,
+                           size_t key_len) {
+  if (x->status != 200 || !x->file || x->file_len > RESP_CACHE_MAX_BODY)
+    return;
+
+  char head[512];
+  size_t head_len = render_fields(head, sizeof(head), x);
+  if (!head_len) return;
+
+  size_t body_len = x->no_body ? 0 : (size_t)x->file_len;
+  char *body;
+  struct resp_entry *entry =
+      resp_entry_create(key, key_len, head, head_len, body_len, &body);
+  if (!entry) return;
+
+  if (x->file->data) {
+    memcpy(body, x->file->data + x->file_offset, body_len);
+  } else {
+    for (size_t done = 0; done < body_len;) {
+      ssize_t n = pread(x->file->fd, body + done, body_len - done,
+                        x->file_offset + (off_t)done);
+      if (n <= 0) {
+        resp_cache_release(entry);
+        return;
+      }
+      done += (size_t)n;
+    }
+  }
+
+  resp_cache_insert(resp_cache, entry, config.cache_ttl_ms);
+}
+
+// answers a request with a cached response
+static int send_cached(struct http_conn *c, struct exchange *x,
+                       const struct resp_entry *entry, int64_t deadline) {
+  const char *conn = connection_field(x->keep_alive);
+  struct iovec iov[3] = {
+      {(char *)resp_entry_head(entry), entry->head_len},
+      {(char *)conn, strlen(conn)},
+      {(char *)resp_entry_body(entry), entry->body_len},
+  };
+  x->bytes_out += iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+  return http_conn_sendv(c, iov, 3, deadline);
+}
+
+// answers a request which couldn't be parsed and closes the connection
+static void refuse(struct http_conn *c, int status, const char *reason) {
+  struct exchange x = {.status = status, .reason = reason};
+  add_field(&x, "Content-Length: 0\r\n");
+  char head[512];
+  struct iovec iov = {head, render_head(head, sizeof(head), &x)};
+
+  int64_t deadline = deadline_in(config.send_timeout_ms);
+  if (http_conn_sendv(c, &iov, 1, deadline) < 0 ||
+      http_conn_close(c, deadline) < 0)
+    http_conn_abort(c);
+  metrics_add(&metrics_local()->errors, 1);
+}
+
+// serves requests off the raw socket fd like serve_connection(), parsing
+// them in place in a buffer which holds pipelined requests too
+static void serve_buffered(int fd) {
+  struct metrics *m = metrics_local();
+  struct http_conn c;
+  struct http_request req;
+  struct exchange x = {0};
+  // what the connection is waiting for, which a timeout is put down to
+  enum metrics_phase phase = PHASE_HEADER;
+  int64_t deadline;
+
+  http_conn_init(&c, fd);
+
+  for (int served = 0;; ++served) {
+    if (!http_conn_pending(&c)) {
+      // idle connections don't hold on to a buffer, and while the first
+      // request has to come soon, later ones may never come
+      if (c.buf) buf_pool_put(&self->pool, c.buf);
+      c.buf = NULL;
+
+      phase = served ? PHASE_IDLE : PHASE_HEADER;
+      deadline = deadline_in(served ? config.keepalive_ms
+                                    : config.header_timeout_ms);
+      if (fdin(fd, deadline) < 0) {
+        if (errno == ETIMEDOUT) metrics_add(&m->timeouts[phase], 1);
+        goto cleanup;
+      }
+
+      char *buf = buf_pool_get(&self->pool, MESSAGE_BUF_SZ);
+      if (!buf) goto cleanup;
+      http_conn_set_buf(&c, buf, MESSAGE_BUF_SZ);
+    }
+
+    // whatever is pending or the next bytes to arrive start a request
+    phase = PHASE_HEADER;
+    long head = http_conn_recv_head(&c, deadline_in(config.header_timeout_ms));
+    if (head < 0) {
+      if (errno == EMSGSIZE) {
+        refuse(&c, 431, "Request Header Fields Too Large");
+        goto release;
+      }
+      // the client went away in between requests
+      if (errno == EPIPE) goto cleanup;
+      goto fail;
+    }
+
+    exchange_init(&x);
+    if (http_parse_request(http_conn_data(&c), (size_t)head, &req) < 0) {
+      refuse(&c, 400, "Bad Request");
+      goto release;
+    }
+    x.bytes_in = (uint64_t)head;
+    // HTTP/1.0 connections only persist if the client asks for it
+    x.keep_alive = http_slice_eq(req.version, "HTTP/1.1");
+
+    for (int i = 0; i < req.n_headers; ++i) {
+      const struct http_header *f = &req.headers[i];
+      log_write(LEVEL_DEBUG, "%.*s: %.*s", (int)f->name.len, f->name.ptr,
+                (int)f->value.len, f->value.ptr);
+      exchange_field(&x, f->id, f->value);
+    }
+    hist_record(&m->parse_us, metrics_now_us() - x.start);
+
+    char key[RESP_CACHE_KEY_SZ];
+    size_t key_len = cache_key(key, sizeof(key), &x, &req);
+    if (key_len) {
+      struct resp_entry *entry = resp_cache_get(resp_cache, key, key_len);
+      if (entry) {
+        metrics_add(&m->cache_hits, 1);
+        if (served + 1 >= config.max_requests) x.keep_alive = false;
+        set_status(&x, 200, "OK");
+        if (log_sample())
+          log_write(LEVEL_INFO, "%.*s %.*s %d (cached)", (int)req.method.len,
+                    req.method.ptr, (int)req.target.len, req.target.ptr,
+                    x.status);
+        http_conn_consume(&c, (size_t)head);
+
+        phase = PHASE_WRITE;
+        int rc = send_cached(&c, &x, entry,
+                             deadline_in(config.send_timeout_ms));
+        resp_cache_release(entry);
+        if (rc < 0) goto fail;
+
+        finish_exchange(&x, m);
+        if (!x.keep_alive) break;
+        continue;
+      }
+      metrics_add(&m->cache_misses, 1);
+    }
+
+    plan_response(&x, req.method, req.target, &req, served);
+    // the request's slices are done with, the body may reuse the buffer
+    http_conn_consume(&c, (size_t)head);
+    if (key_len) cache_response(&x, key, key_len);
+
+    // the head goes out in one go with a page or small file, larger files
+    // follow through sendfile()
+    char head_buf[512];
+    struct iovec iov[2] = {
+        {head_buf, render_head(head_buf, sizeof(head_buf), &x)},
+        {NULL, 0},
+    };
+    bool send_file = !x.no_body && x.file && !x.file->data;
+    if (!x.no_body && x.page) {
+      iov[1] = (struct iovec){x.page, x.page_len};
+    } else if (!x.no_body && x.file && x.file->data) {
+      iov[1] = (struct iovec){(char *)x.file->data + x.file_offset,
+                              (size_t)x.file_len};
+    }
+    x.bytes_out += iov[0].iov_len + iov[1].iov_len;
+    phase = PHASE_WRITE;
+    deadline = deadline_in(config.send_timeout_ms);
+    if (http_conn_sendv(&c, iov, iov[1].iov_len ? 2 : 1, deadline) < 0)
+      goto fail;
+    if (send_file) {
+      if (static_file_send(fd, x.file, x.file_offset, x.file_len, deadline) <
+          0)
+        goto fail;
+      x.bytes_out += (uint64_t)x.file_len;
+    }
+    release_body(&x);
+
+    // consume the body so that the next request starts where it ends,
+    // chunked ones over the limit are cut off with the connection
+    if (!x.skip_body && (x.body.chunked || x.body.length)) {
+      phase = PHASE_BODY;
+      long n = recv_body(&c, -1, &x.body);
+      if (n < 0) goto fail;
+      x.bytes_in += n;
+    }
+
+    finish_exchange(&x, m);
+    if (!x.keep_alive) break;
+  }
+
+  // waits for the client to close its side after taking the response
+  if (http_conn_close(&c, deadline_in(config.send_timeout_ms)) == 0)
+    goto release;
+  if (errno == ETIMEDOUT) metrics_add(&m->timeouts[PHASE_WRITE], 1);
+  goto cleanup;
+
+fail:
+  // the request was cut short
+  metrics_add(&m->errors, 1);
+  if (errno == ETIMEDOUT) metrics_add(&m->timeouts[phase], 1);
+cleanup:
+  http_conn_abort(&c);
+release:
+  release_body(&x);
+  if (c.buf) buf_pool_put(&self->pool, c.buf);
+}
+
+static coroutine void worker(int fd, uint32_t slot);
+
+// creates the slots and the stacks for the calling slave's workers
+static int open_workers(void) {
+  struct workers *w = &self->workers;
+  uint32_t n = config.max_coroutines;
+  self->waiting_for_room = false;
+  self->stopping = false;
+
+  w->slots = malloc(n * sizeof(*w->slots));
+  w->free = malloc(n * sizeof(*w->free));
+  w->done = malloc(n * sizeof(*w->done));
+  if (!w->slots || !w->free || !w->done) goto fail;
+  if (stack_pool_init(&w->stacks, config.stack_size, n) < 0) goto fail;
+  if (chmake(self->room) < 0) goto fail_stacks;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    w->slots[i].cr = -1;
+    // the low slots are handed out first
+    w->free[i] = n - 1 - i;
+  }
+  w->n_free = n;
+  w->n_done = 0;
+
+  return 0;
+
+fail_stacks:
+  stack_pool_destroy(&w->stacks);
+fail:
+  free(w->slots);
+  free(w->free);
+  free(w->done);
+  return -1;
+}
+
+// Closes the worker in slot i, which cancels it unless it's done, then puts
+// its stack back: nothing runs on the stack once hclose() returned.
+static void close_slot(uint32_t i) {
+  struct workers *w = &self->workers;
+  int cr = w->slots[i].cr;
+  if (cr < 0) return;
+
+  // taken first, as the slot may be looked at again while hclose() waits
+  w->slots[i].cr = -1;
+  hclose(cr);
+  stack_pool_put(&w->stacks, w->slots[i].stack);
+  w->free[w->n_free++] = i;
+}
+
+// closes the workers which finished since the last time
+static void reap_workers(void) {
+  struct workers *w = &self->workers;
+  while (w->n_done) close_slot(w->done[--w->n_done]);
+}
+
+// cancels every worker still running, which closes its connection
+static void cancel_workers(void) {
+  reap_workers();
+  for (uint32_t i = 0; i < config.max_coroutines; ++i) close_slot(i);
+}
+
+// cancels the workers that are left and unmaps their stacks
+static void close_workers(void) {
+  struct workers *w = &self->workers;
+  self->stopping = true;
+  cancel_workers();
+
+  hclose(self->room[0]);
+  hclose(self->room[1]);
+  stack_pool_destroy(&w->stacks);
+  free(w->slots);
+  free(w->free);
+  free(w->done);
+}
+
+// workers the calling slave may still start
+static uint32_t worker_room(void) {
+  uint32_t active = atomic_load_explicit(&self->active, memory_order_relaxed);
+  return active < config.max_coroutines ? config.max_coroutines - active : 0;
+}
+
+// Waits for the calling slave to be under --max-coroutines, leaving its
+// connections queued (or in the listener's backlog) until then. Returns -1
+// once the slave is stopping, or with ECANCELED in a cancelled coroutine.
+static int wait_for_room(void) {
+  while (!self->stopping && !worker_room()) {
+    char c;
+    self->waiting_for_room = true;
+    int rc = chrecv(self->room[0], &c, 1, -1);
+    self->waiting_for_room = false;
+    if (rc < 0) return -1;
+  }
+
+  return self->stopping ? -1 : 0;
+}
+
+// wakes the slave up if it waits for room, cancelled coroutines can't
+static void wake_slave(void) {
+  if (!self->waiting_for_room) return;
+
+  char c = 0;
+  chsend(self->room[1], &c, 1, 0);
+}
+
+// starts a worker coroutine for the raw socket fd in a free slot of the
+// calling slave, accounted for in its load
+static int start_worker(int fd) {
+  struct workers *w = &self->workers;
+  reap_workers();
+  if (!w->n_free) {
+    errno = EAGAIN;
+    return -1;
+  }
+  void *stack = stack_pool_get(&w->stacks);
+  if (!stack) return -1;
+
+  uint32_t i = w->free[--w->n_free];
+  w->slots[i].stack = stack;
+  atomic_fetch_add_explicit(&self->active, 1, memory_order_relaxed);
+  metrics_add(&metrics_local()->accepted, 1);
+
+  // the worker may run, and even finish, before go_mem() returns; it's only
+  // closed by reap_workers() later on
+  int cr = go_mem(worker(fd, i), stack, w->stacks.size);
+  if (cr < 0) {
+    atomic_fetch_sub_explicit(&self->active, 1, memory_order_relaxed);
+    stack_pool_put(&w->stacks, stack);
+    w->free[w->n_free++] = i;
+    return -1;
+  }
+  w->slots[i].cr = cr;
+
+  return 0;
+}
+
+static coroutine void worker(int fd, uint32_t slot) {
+  if (config.parser == PARSER_LIBDILL) {
+    int s = tcp_fromfd(fd);
+    if (s < 0) {
+      perror("Can't wrap an OS connection");
+      fdclean(fd);
+      close(fd);
+    } else {
+      serve_connection(s);
+    }
+  } else {
+    serve_buffered(fd);
+  }
+
+  atomic_fetch_sub_explicit(&self->active, 1, memory_order_relaxed);
+  // the slave closes this coroutine, and only then reuses its stack
+  struct workers *w = &self->workers;
+  w->done[w->n_done++] = slot;
+  wake_slave();
+}
+
+// Cancels the slave's workers as soon as shutdown begins rather than waiting
+// on their clients. The slave keeps popping its queue until the shutdown
+// message, so that the push of that message can't block on a full queue.
+static coroutine void stop_workers(void) {
+  if (fdin(shutdown_pipe[0], -1) < 0) return;
+
+  self->stopping = true;
+  cancel_workers();
+  wake_slave();
 }
 
-static void *slave(void *q) {
+// takes pending sockets off the queue of a backed up sibling
+static uint32_t steal_work(struct conn_msg *items, uint32_t max) {
+  for (int i = 1; i < self->n_siblings; ++i) {
+    struct slave_ctx *victim =
+        &self->siblings[(self->id + i) % self->n_siblings];
+
+    // leave the victim at least half of its backlog
+    uint32_t queued = rpa_queue_size(victim->queue);
+    if (queued < STEAL_MIN_QUEUED) continue;
+
+    uint32_t n = conn_queue_steal_batch(victim->queue, items,
+                                        queued / 2 < max ? queued / 2 : max);
+
+    // never run off with the sibling's shutdown message
+    for (uint32_t j = 0; j < n; ++j) {
+      if (items[j].fd == SHUTDOWN_FD) {
+        conn_queue_push(victim->queue, &shutdown_msg, RPA_WAIT_FOREVER);
+        items[j--] = items[--n];
+      }
+    }
+
+    if (n) return n;
+  }
+
+  return 0;
+}
+
+static void *slave(void *arg) {
   int rc = block_signal(SIGINT);
   if (rc < 0) {
     perror("Can't block signals");
     return NULL;
   }
 
-  rpa_queue_t *queue = (rpa_queue_t *)q;
+  self = (struct slave_ctx *)arg;
+  log_attach(self->id);
+  metrics_attach(self->id);
+  rpa_queue_t *queue = self->queue;
 
-  while (1) {
-    int s;
-    if (!rpa_queue_pop(queue, (void **)&s)) {
+  if (open_workers() < 0) {
+    perror("Can't set up the workers");
+    return NULL;
+  }
+  int stop_cr = go(stop_workers());
+  if (stop_cr < 0) {
+    perror("Can't start a coroutine");
+    close_workers();
+    return NULL;
+  }
+
+  bool shutdown = false;
+  while (!shutdown) {
+    struct conn_msg items[DISPATCH_BATCH];
+    uint32_t n;
+
+    // pop no more than there's room for, the rest stay queued where the
+    // dispatcher sees them
+    uint32_t max = DISPATCH_BATCH;
+    if (wait_for_room() == 0 && worker_room() < max) max = worker_room();
+
+    if (config.steal_ms && !self->stopping) {
+      // own work first, then the siblings', then sleep until the next round
+      n = conn_queue_pop_batch(queue, items, max, RPA_WAIT_NONE);
+      if (!n) n = steal_work(items, max);
+      if (!n)
+        n = conn_queue_fdpop_batch(queue, items, max, fdin,
+                                   now() + config.steal_ms);
+      if (!n && errno == ETIMEDOUT) continue;
+    } else {
+      // wait through libdill so that in-flight workers keep running
+      n = conn_queue_fdpop_batch(queue, items, max, fdin, -1);
+    }
+
+    if (!n) {
       fprintf(stderr, "Can't pop item off a queue\n");
-      return NULL;
+      break;
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+      int s = items[i].fd;
+      if (s == SHUTDOWN_FD) {
+        shutdown = true;
+        continue;
+      }
+      if (self->stopping || shutdown) {
+        close(s);
+        continue;
+      }
+
+      metrics_record_dispatch(items[i].accepted_us);
+
+      // the worker waits for the first request, under a deadline
+      rc = start_worker(s);
+      if (rc < 0) {
+        perror("Can't start a coroutine");
+        close(s);
+      }
     }
+  }
 
-    if (s == -1) break;
+  hclose(stop_cr);
+  close_workers();
 
-    int rc = fdin(s, -1);
-    if (rc < 0) {
-      perror("OS socket not readable");
-      return NULL;
+  return NULL;
+}
+
+// connections a slave is busy with or has yet to pick up
+static uint32_t slave_load(struct slave_ctx *slave) {
+  return atomic_load_explicit(&slave->active, memory_order_relaxed) +
+         rpa_queue_size(slave->queue);
+}
+
+// connections a slave may still be handed under the admission limit
+static uint32_t slave_room(struct slave_ctx *slave) {
+  if (!config.max_conns) return UINT32_MAX;
+
+  uint32_t load = slave_load(slave);
+  return load < config.max_conns ? config.max_conns - load : 0;
+}
+
+// turns a connection away without ever handing it to a slave
+static void shed(int s) {
+  if (config.shed == SHED_503) {
+    // the socket is non-blocking and fresh, so this fits or is dropped
+    ssize_t rc = send(s, SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1,
+                      MSG_NOSIGNAL);
+    (void)rc;
+  }
+  close(s);
+  metrics_add(&metrics_local()->shed, 1);
+}
+
+// whether any connections are critical, which needs queues with classes
+static bool has_classes(void) {
+  return config.critical_port || config.n_critical_nets;
+}
+
+// the class of a connection from peer, accepted on a listener of class cls
+static enum conn_class classify(const struct sockaddr_in *peer,
+                                enum conn_class cls) {
+  for (int i = 0; i < config.n_critical_nets && cls != CLASS_CRITICAL; ++i) {
+    const struct subnet *net = &config.critical_nets[i];
+    if ((peer->sin_addr.s_addr & net->mask) == net->addr) cls = CLASS_CRITICAL;
+  }
+  return cls;
+}
+
+// hands a batch of the given class to the slave it was meant for, spills
+// what doesn't fit over to the others and sheds what none of them has room
+// for
+static void flush_batch(struct slave_ctx *slaves, int n_proc, int target,
+                        enum conn_class cls, struct conn_msg *items,
+                        uint32_t *n) {
+  if (!*n) return;
+
+  uint32_t done = 0;
+  for (int i = 0; i < n_proc && done < *n; ++i) {
+    struct slave_ctx *slave = &slaves[(target + i) % n_proc];
+
+    uint32_t room = slave_room(slave);
+    uint32_t want = *n - done < room ? *n - done : room;
+    if (!want) continue;
+
+    // only the intended slave is worth waiting for
+    done += conn_queue_push_class(slave->queue, cls, items + done, want,
+                                  i ? RPA_WAIT_NONE : config.push_wait_ms);
+  }
+
+  if (done < *n)
+    log_write(LEVEL_DEBUG, "Shedding %u connections", *n - done);
+  for (; done < *n; ++done) shed(items[done].fd);
+
+  *n = 0;
+}
+
+// the sockets a dispatcher accepted for each slave but hasn't pushed yet
+struct dispatch_batches {
+  struct conn_msg (*items)[DISPATCH_BATCH];
+  uint32_t *counts;
+};
+
+static int dispatch_batches_init(struct dispatch_batches *b, int n_proc) {
+  b->items = malloc(n_proc * sizeof(*b->items));
+  b->counts = calloc(n_proc, sizeof(*b->counts));
+  if (!b->items || !b->counts) {
+    free(b->items);
+    free(b->counts);
+    b->items = NULL;
+    b->counts = NULL;
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+static void dispatch_batches_free(struct dispatch_batches *b) {
+  free(b->items);
+  free(b->counts);
+}
+
+static uint32_t xorshift32(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// accepts connections on fd, which are of class cls unless classify() finds
+// them critical, batching them up in b
+static coroutine void dispatcher(int fd, enum conn_class cls,
+                                 struct slave_ctx *slaves, int n_proc,
+                                 struct dispatch_batches *b) {
+  int c_proc = 0;
+  uint32_t seed = (uint32_t)now() | 1;
+  struct conn_msg(*batches)[DISPATCH_BATCH] = b->items;
+  uint32_t *counts = b->counts;
+
+  while (1) {
+    // sleep until the backlog is non-empty, wakes up with ECANCELED on exit
+    int rc = fdin(fd, -1);
+    if (rc < 0) break;
+
+    // drain the backlog, handing the sockets over in batches
+    while (1) {
+      struct sockaddr_in peer;
+      int s = accept_nb(fd, config.n_critical_nets ? &peer : NULL);
+      if (s < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          perror("Can't accept a connection");
+          // e.g. out of descriptors, give the slaves a moment to close some
+          msleep(now() + 10);
+        }
+        break;
+      }
+      uint64_t accepted_us = metrics_now_us();
+
+      // sockets batched up but not pushed yet count towards the load too
+      if (config.policy == POLICY_LEAST_LOADED) {
+        // start the scan at the round-robin position to spread out ties
+        uint32_t best = UINT32_MAX;
+        for (int i = 0, start = c_proc; i < n_proc; ++i) {
+          int j = (start + i) % n_proc;
+          uint32_t load = slave_load(&slaves[j]) + counts[j];
+          if (load < best) {
+            best = load;
+            c_proc = j;
+          }
+        }
+      } else if (config.policy == POLICY_TWO_CHOICES && n_proc > 1) {
+        int a = xorshift32(&seed) % n_proc;
+        int b = xorshift32(&seed) % (n_proc - 1);
+        if (b >= a) b++;
+        c_proc = slave_load(&slaves[a]) + counts[a] <=
+                         slave_load(&slaves[b]) + counts[b]
+                     ? a
+                     : b;
+      }
+
+      struct conn_msg msg = {.fd = s, .accepted_us = accepted_us};
+      if ((config.n_critical_nets ? classify(&peer, cls) : cls) ==
+          CLASS_CRITICAL) {
+        // not worth holding back for a batch
+        uint32_t one = 1;
+        flush_batch(slaves, n_proc, c_proc, CLASS_CRITICAL, &msg, &one);
+      } else {
+        batches[c_proc][counts[c_proc]++] = msg;
+        if (counts[c_proc] == DISPATCH_BATCH)
+          flush_batch(slaves, n_proc, c_proc, cls, batches[c_proc],
+                      &counts[c_proc]);
+      }
+
+      log_write(LEVEL_DEBUG, "New connection %d on thread %d", s, c_proc);
+
+      c_proc = (c_proc + 1 == n_proc ? 0 : c_proc + 1);
     }
 
-    s = tcp_fromfd(s);
+    for (int i = 0; i < n_proc; ++i)
+      flush_batch(slaves, n_proc, i, cls, batches[i], &counts[i]);
+  }
+}
+
+static coroutine void acceptor(int fd) {
+  while (1) {
+    // at --max-coroutines the connections wait in the listener's backlog
+    if (wait_for_room() < 0) return;
+
+    int s = accept_nb(fd, NULL);
     if (s < 0) {
-      perror("Can't wrap an OS connection");
-      return NULL;
+      // either wakes up with ECANCELED on exit
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (fdin(fd, -1) < 0) return;
+      } else if (errno != EINTR && errno != ECONNABORTED) {
+        // e.g. out of descriptors, give the workers a moment to close some
+        if (msleep(now() + 10) < 0) return;
+      }
+      continue;
     }
 
-    int cr = go(worker(s));
-    if (cr < 0) {
+    if (config.max_conns &&
+        atomic_load_explicit(&self->active, memory_order_relaxed) >=
+            config.max_conns) {
+      shed(s);
+      continue;
+    }
+
+    int rc = start_worker(s);
+    if (rc < 0) {
       perror("Can't start a coroutine");
-      return NULL;
+      close(s);
     }
   }
+}
+
+static void *listener_slave(void *arg) {
+  int rc = block_signal(SIGINT);
+  if (rc < 0) {
+    perror("Can't block signals");
+    return NULL;
+  }
+
+  self = (struct slave_ctx *)arg;
+  log_attach(self->id);
+  metrics_attach(self->id);
+
+  int fd = open_listener(config.port, true);
+  if (fd < 0) return NULL;
+
+  if (open_workers() < 0) {
+    perror("Can't set up the workers");
+    close(fd);
+    return NULL;
+  }
+
+  int cr = go(acceptor(fd));
+  if (cr < 0) {
+    perror("Can't start a coroutine");
+    close_workers();
+    close(fd);
+    return NULL;
+  }
+
+  // serve connections until shutdown
+  rc = fdin(shutdown_pipe[0], -1);
+  if (rc < 0) perror("Can't wait for shutdown");
+
+  hclose(cr);
+  fdclean(fd);
+  close(fd);
+  close_workers();
 
   return NULL;
 }
 
+// parses an IPv4 subnet such as 10.0.0.0/8, a bare address being a /32
+static int parse_subnet(const char *arg, struct subnet *net) {
+  char addr[INET_ADDRSTRLEN];
+  const char *slash = strchr(arg, '/');
+  size_t len = slash ? (size_t)(slash - arg) : strlen(arg);
+  if (len >= sizeof(addr)) return -1;
+  memcpy(addr, arg, len);
+  addr[len] = '\0';
+
+  struct in_addr in;
+  if (inet_pton(AF_INET, addr, &in) != 1) return -1;
+
+  unsigned long bits = 32;
+  if (slash) {
+    char *end;
+    bits = strtoul(slash + 1, &end, 10);
+    if (end == slash + 1 || *end || bits > 32) return -1;
+  }
+
+  net->mask = bits ? htonl(~0u << (32 - bits)) : 0;
+  net->addr = in.s_addr & net->mask;
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [port]\n"
+          "  -p, --port PORT    port to listen on (default 1234)\n"
+          "  -b, --backlog N    listen backlog (default SOMAXCONN)\n"
+          "  -t, --threads N    slave threads (default one less than the "
+          "cpus)\n"
+          "  -m, --mode MODE    queue: one thread accepts and dispatches "
+          "to the slaves (default)\n"
+          "                     reuseport: every slave accepts on its own "
+          "SO_REUSEPORT listener\n"
+          "  -d, --dispatch POL rr: round-robin (default), least: least "
+          "loaded slave,\n"
+          "                     p2c: less loaded of two random slaves\n"
+          "  -s, --steal MS     let idle slaves take queued sockets from "
+          "their siblings,\n"
+          "                     looking every MS milliseconds\n"
+          "  -k, --keepalive MS close connections idle for MS milliseconds "
+          "(default 5000)\n"
+          "  -H, --header-timeout MS\n"
+          "                     close connections whose request head takes "
+          "longer than\n"
+          "                     MS milliseconds (default 10000)\n"
+          "  -y, --body-timeout MS\n"
+          "                     allow request bodies MS milliseconds "
+          "(default 10000)...\n"
+          "  -L, --body-rate N  ...plus the time N bytes per second would take "
+          "(default\n"
+          "                     1024, 0 for a fixed limit)\n"
+          "  -O, --send-timeout MS\n"
+          "                     close connections which don't take a "
+          "response within MS\n"
+          "                     milliseconds (default 10000)\n"
+          "  -r, --max-requests N\n"
+          "                     close connections after N requests (default "
+          "100)\n"
+          "  -B, --max-body N   refuse request bodies over N bytes (default "
+          "1 MiB)\n"
+          "  -l, --log-level L  error, warn, info (default) or debug\n"
+          "  -a, --access-log N log one in every N requests (default 1, 0 "
+          "disables)\n"
+          "  -q, --queue-stats  count queue traffic, waits and contention "
+          "for /metrics\n"
+          "  -Q, --queue-capacity N\n"
+          "                     sockets queued per slave (default 64)\n"
+          "  -w, --push-wait MS wait up to MS milliseconds for a full queue "
+          "before\n"
+          "                     spilling over to the other slaves (default "
+          "0)\n"
+          "  -c, --max-conns N  connections a slave may have active or "
+          "queued (default\n"
+          "                     unlimited)\n"
+          "  -S, --shed POLICY  503 (default) or close connections no slave "
+          "has room for\n"
+          "  -K, --max-coroutines N\n"
+          "                     connections a slave serves at once, the "
+          "others wait in its\n"
+          "                     queue or the listen backlog (default 1024)\n"
+          "  -Z, --stack-size N bytes of every connection's coroutine stack "
+          "(default 64 KiB)\n"
+          "  -C, --cpus LIST    pin the acceptor and then the slaves to these "
+          "cpus in turn,\n"
+          "                     e.g. 0-3,8\n"
+          "  -P, --placement P  pick the cpus from the topology: compact "
+          "fills one socket\n"
+          "                     first, spread alternates between sockets, "
+          "none (default)\n"
+          "                     leaves it to the scheduler\n"
+          "  -R, --critical-port PORT\n"
+          "                     also listen on PORT, queueing its "
+          "connections ahead of\n"
+          "                     the others\n"
+          "  -N, --critical-net CIDR\n"
+          "                     queue connections from this subnet ahead of "
+          "the others,\n"
+          "                     may be repeated\n"
+          "  -W, --critical-weight N\n"
+          "                     dequeue N critical connections for every "
+          "other one\n"
+          "                     instead of all of them first (default 0)\n"
+          "  -x, --parser P     buffered: parse requests in place with SIMD "
+          "scans (default),\n"
+          "                     libdill: libdill's HTTP protocol\n"
+          "  -D, --root DIR     serve the files in DIR, with sendfile() or "
+          "from memory\n"
+          "                     for small ones\n"
+          "  -M, --cache-size N keep up to N bytes of responses to file "
+          "requests in memory\n"
+          "                     (default 0, no cache)\n"
+          "  -T, --cache-ttl MS keep cached responses for MS milliseconds "
+          "(default 1000)\n"
+          "  -h, --help         show this message\n",
+          prog);
+}
+
+static int parse_args(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"port", required_argument, NULL, 'p'},
+      {"backlog", required_argument, NULL, 'b'},
+      {"threads", required_argument, NULL, 't'},
+      {"mode", required_argument, NULL, 'm'},
+      {"dispatch", required_argument, NULL, 'd'},
+      {"steal", required_argument, NULL, 's'},
+      {"keepalive", required_argument, NULL, 'k'},
+      {"header-timeout", required_argument, NULL, 'H'},
+      {"body-timeout", required_argument, NULL, 'y'},
+      {"body-rate", required_argument, NULL, 'L'},
+      {"send-timeout", required_argument, NULL, 'O'},
+      {"max-requests", required_argument, NULL, 'r'},
+      {"max-body", required_argument, NULL, 'B'},
+      {"log-level", required_argument, NULL, 'l'},
+      {"access-log", required_argument, NULL, 'a'},
+      {"queue-stats", no_argument, NULL, 'q'},
+      {"queue-capacity", required_argument, NULL, 'Q'},
+      {"push-wait", required_argument, NULL, 'w'},
+      {"max-conns", required_argument, NULL, 'c'},
+      {"shed", required_argument, NULL, 'S'},
+      {"max-coroutines", required_argument, NULL, 'K'},
+      {"stack-size", required_argument, NULL, 'Z'},
+      {"cpus", required_argument, NULL, 'C'},
+      {"placement", required_argument, NULL, 'P'},
+      {"critical-port", required_argument, NULL, 'R'},
+      {"critical-net", required_argument, NULL, 'N'},
+      {"critical-weight", required_argument, NULL, 'W'},
+      {"parser", required_argument, NULL, 'x'},
+      {"root", required_argument, NULL, 'D'},
+      {"cache-size", required_argument, NULL, 'M'},
+      {"cache-ttl", required_argument, NULL, 'T'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv,
+                            "p:b:t:m:d:s:k:H:y:L:O:r:B:l:a:qQ:w:c:S:C:"
+                            "K:Z:P:R:N:W:x:D:M:T:h",
+                            options, NULL)) != -1) {
+    switch (opt) {
+      case 'p':
+        config.port = atoi(optarg);
+        break;
+      case 'b':
+        config.backlog = atoi(optarg);
+        break;
+      case 't':
+        config.threads = atoi(optarg);
+        break;
+      case 'm':
+        if (!strcmp(optarg, "queue")) {
+          config.mode = MODE_QUEUE;
+        } else if (!strcmp(optarg, "reuseport")) {
+          config.mode = MODE_REUSEPORT;
+        } else {
+          fprintf(stderr, "Unknown mode: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'd':
+        if (!strcmp(optarg, "rr")) {
+          config.policy = POLICY_ROUND_ROBIN;
+        } else if (!strcmp(optarg, "least")) {
+          config.policy = POLICY_LEAST_LOADED;
+        } else if (!strcmp(optarg, "p2c")) {
+          config.policy = POLICY_TWO_CHOICES;
+        } else {
+          fprintf(stderr, "Unknown dispatch policy: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 's':
+        config.steal_ms = atoi(optarg);
+        break;
+      case 'k':
+        config.keepalive_ms = atoi(optarg);
+        break;
+      case 'H':
+        config.header_timeout_ms = atoi(optarg);
+        break;
+      case 'y':
+        config.body_timeout_ms = atoi(optarg);
+        break;
+      case 'L':
+        config.body_rate = strtoul(optarg, NULL, 10);
+        break;
+      case 'O':
+        config.send_timeout_ms = atoi(optarg);
+        break;
+      case 'r':
+        config.max_requests = atoi(optarg);
+        break;
+      case 'B':
+        config.max_body = strtoul(optarg, NULL, 10);
+        break;
+      case 'l': {
+        static const char *levels[] = {"error", "warn", "info", "debug"};
+        int i = 0;
+        while (i < 4 && strcmp(optarg, levels[i])) ++i;
+        if (i == 4) {
+          fprintf(stderr, "Unknown log level: %s\n", optarg);
+          return -1;
+        }
+        config.log_level = (enum log_level)i;
+        break;
+      }
+      case 'a':
+        config.access_sample = strtoul(optarg, NULL, 10);
+        break;
+      case 'q':
+        config.queue_stats = true;
+        break;
+      case 'Q':
+        config.queue_capacity = strtoul(optarg, NULL, 10);
+        if (!config.queue_capacity) {
+          fprintf(stderr, "Queue capacity must be positive\n");
+          return -1;
+        }
+        break;
+      case 'w':
+        config.push_wait_ms = atoi(optarg);
+        break;
+      case 'c':
+        config.max_conns = strtoul(optarg, NULL, 10);
+        break;
+      case 'S':
+        if (!strcmp(optarg, "503")) {
+          config.shed = SHED_503;
+        } else if (!strcmp(optarg, "close")) {
+          config.shed = SHED_CLOSE;
+        } else {
+          fprintf(stderr, "Unknown shed policy: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'K':
+        config.max_coroutines = strtoul(optarg, NULL, 10);
+        if (!config.max_coroutines) {
+          fprintf(stderr, "Max coroutines must be positive\n");
+          return -1;
+        }
+        break;
+      case 'Z':
+        config.stack_size = strtoul(optarg, NULL, 10);
+        if (config.stack_size < MIN_STACK_SIZE) {
+          fprintf(stderr, "Stacks must be at least %u bytes\n",
+                  MIN_STACK_SIZE);
+          return -1;
+        }
+        break;
+      case 'C':
+        config.n_cpus = cpu_list_parse(optarg, config.cpus, MAX_CPUS);
+        if (config.n_cpus <= 0) {
+          fprintf(stderr, "Bad cpu list: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'P':
+        if (!strcmp(optarg, "none")) {
+          config.placement = PLACEMENT_NONE;
+        } else if (!strcmp(optarg, "compact")) {
+          config.placement = PLACEMENT_COMPACT;
+        } else if (!strcmp(optarg, "spread")) {
+          config.placement = PLACEMENT_SPREAD;
+        } else {
+          fprintf(stderr, "Unknown placement: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'R':
+        config.critical_port = atoi(optarg);
+        break;
+      case 'N':
+        if (config.n_critical_nets == MAX_CRITICAL_NETS) {
+          fprintf(stderr, "At most %d critical subnets\n", MAX_CRITICAL_NETS);
+          return -1;
+        }
+        if (parse_subnet(optarg,
+                         &config.critical_nets[config.n_critical_nets]) < 0) {
+          fprintf(stderr, "Bad subnet: %s\n", optarg);
+          return -1;
+        }
+        config.n_critical_nets++;
+        break;
+      case 'W':
+        config.critical_weight = strtoul(optarg, NULL, 10);
+        break;
+      case 'x':
+        if (!strcmp(optarg, "buffered")) {
+          config.parser = PARSER_BUFFERED;
+        } else if (!strcmp(optarg, "libdill")) {
+          config.parser = PARSER_LIBDILL;
+        } else {
+          fprintf(stderr, "Unknown parser: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'D':
+        config.root = optarg;
+        break;
+      case 'M':
+        config.cache_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'T':
+        config.cache_ttl_ms = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+
+  // the port used to be the only, positional argument
+  if (optind < argc) config.port = atoi(argv[optind]);
+
+  if (config.mode == MODE_REUSEPORT && has_classes()) {
+    fprintf(stderr, "Critical connections need the queue mode\n");
+    return -1;
+  }
+
+  if (config.root && config.parser == PARSER_LIBDILL) {
+    fprintf(stderr, "Serving files needs the buffered parser\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+// creates the slaves, with file caches under root_fd unless it's -1
+static struct slave_ctx *create_slaves(int n_proc, int root_fd) {
+  struct slave_ctx *slaves =
+      aligned_alloc(RPA_CACHE_LINE, n_proc * sizeof(struct slave_ctx));
+  if (!slaves) return NULL;
+
+  for (int i = 0; i < n_proc; ++i) {
+    atomic_init(&slaves[i].active, 0);
+    slaves[i].id = i;
+    slaves[i].queue = NULL;
+    buf_pool_init(&slaves[i].pool, POOL_CLASS_BUDGET);
+    slaves[i].files = NULL;
+    if (root_fd >= 0) {
+      slaves[i].files = static_cache_create(root_fd, FILE_CACHE_SLOTS);
+      if (!slaves[i].files) return NULL;
+    }
+    slaves[i].siblings = slaves;
+    slaves[i].n_siblings = n_proc;
+    slaves[i].cpu = -1;
+  }
+
+  return slaves;
+}
+
+// cpus for the acceptor and the slaves, in this order and wrapping around
+// when there are fewer; returns how many there are, 0 to leave the threads
+// unpinned
+static int plan_placement(int *cpus) {
+  if (config.n_cpus) {
+    memcpy(cpus, config.cpus, config.n_cpus * sizeof(int));
+    return config.n_cpus;
+  }
+  if (config.placement == PLACEMENT_NONE) return 0;
+
+  int n = cpu_placement(config.placement, cpus, MAX_CPUS);
+  if (n <= 0) {
+    perror("Can't read the cpu topology, not pinning");
+    return 0;
+  }
+  return n;
+}
+
+// starts a slave's thread, pinned to its cpu if it has one
+static int start_slave(struct slave_ctx *slave, void *(*fn)(void *)) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+
+  // an unpinned slave is slower but still works
+  if (slave->cpu >= 0 && cpu_attr_pin(&attr, slave->cpu) < 0)
+    perror("Can't pin a slave thread");
+
+  int rc = pthread_create(&slave->thread, &attr, fn, slave);
+  pthread_attr_destroy(&attr);
+
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  return 0;
+}
+
+static int serve_reuseport(struct slave_ctx *slaves, int n_proc) {
+  // start the threads
+  for (int i = 0; i < n_proc; ++i) {
+    int rc = start_slave(&slaves[i], listener_slave);
+    if (rc < 0) {
+      perror("Can't create a thread");
+      return 1;
+    }
+  }
+
+  // the slaves accept by themselves, just wait for the signal
+  int rc = fdin(shutdown_pipe[0], -1);
+  if (rc < 0) {
+    perror("Can't wait for shutdown");
+    return 1;
+  }
+
+  printf("\nClosing connections...\n");
+
+  // join the threads
+  for (int i = 0; i < n_proc; ++i) {
+    int rc = pthread_join(slaves[i].thread, NULL);
+    if (rc != 0) {
+      perror("Can't join a thread");
+      return 1;
+    }
+    buf_pool_destroy(&slaves[i].pool);
+    static_cache_destroy(slaves[i].files);
+    printf("Thread %d finished\n", i);
+  }
+
+  log_shutdown();
+  resp_cache_destroy(resp_cache);
+
+  printf("Closed connections\n");
+
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
+  if (parse_args(argc, argv) < 0) return 1;
+
+  if (pipe(shutdown_pipe) < 0) {
+    perror("Can't create shutdown pipe");
+    return 1;
+  }
+
   // set signal handler
   int rc = set_sig_handler();
   if (rc < 0) {
@@ -213,86 +2103,148 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  int port = 1234;
-  if (argc > 1) port = atoi(argv[1]);
+  // prepare the threads, by default one for every cpu but the acceptor's;
+  // with a single cpu the acceptor shares it with the one slave
+  int *cpus = malloc(MAX_CPUS * sizeof(int));
+  if (!cpus) {
+    perror("Can't allocate the cpu list");
+    return 1;
+  }
+  int n_cpus = plan_placement(cpus);
+
+  int n_proc = config.threads;
+  if (n_proc <= 0) n_proc = (config.n_cpus ? config.n_cpus : cpu_num()) - 1;
+  if (n_proc < 1) n_proc = 1;
+
+  // the slaves' file caches open everything relative to the root
+  int root_fd = -1;
+  if (config.root) {
+    root_fd = open(config.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+      perror("Can't open the root directory");
+      return 1;
+    }
+  }
 
-  struct sockaddr_in serv_addr, cli_addr;
-  socklen_t cli_len = sizeof(cli_addr);
+  if (config.root && config.cache_size) {
+    resp_cache = resp_cache_create(config.cache_size);
+    if (!resp_cache) {
+      perror("Can't allocate the response cache");
+      return 1;
+    }
+  }
 
-  // create the socket
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd < 0) {
-    perror("Failed to open socket");
+  struct slave_ctx *slaves = create_slaves(n_proc, root_fd);
+  if (!slaves) {
+    perror("Can't allocate the slaves");
     return 1;
   }
 
-  unblock(fd);
-  bzero((char *)&serv_addr, sizeof(serv_addr));
-
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = INADDR_ANY;
-  serv_addr.sin_port = htons(port);
+  if (n_cpus) {
+    for (int i = 0; i < n_proc; ++i) slaves[i].cpu = cpus[(i + 1) % n_cpus];
+    // the log flusher started below inherits this and shares the cpu with
+    // the acceptor, the slaves are pinned to their own as they're created
+    if (cpu_pin_self(cpus[0]) < 0) perror("Can't pin the acceptor thread");
+  }
+  free(cpus);
 
-  // bind the socket
-  rc = bind(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
-  if (rc < 0) {
-    perror("Failed to bind socket");
+  // one log ring for every slave and one for the main thread
+  if (log_init(n_proc + 1, config.log_level, config.access_sample) < 0) {
+    perror("Can't start logging");
     return 1;
   }
+  log_attach(n_proc);
 
-  // listen for connections
-  rc = listen(fd, 64);
-  if (rc < 0) {
-    perror("Failed to listen on socket");
+  // likewise one block of metrics for every slave and one for the main thread
+  if (metrics_init(n_proc + 1) < 0) {
+    perror("Can't allocate the metrics");
     return 1;
   }
+  metrics_attach(n_proc);
 
-  // prepare the threads
-  int c_proc = 0;
-  int n_proc = cpu_num() - 1;
+  if (config.mode == MODE_REUSEPORT) return serve_reuseport(slaves, n_proc);
 
-  if (!n_proc) {
-    fprintf(stderr, "only one cpu, aborting...\n");
-    return 1;
+  int fd = open_listener(config.port, false);
+  if (fd < 0) return 1;
+
+  int critical_fd = -1;
+  if (config.critical_port) {
+    critical_fd = open_listener(config.critical_port, false);
+    if (critical_fd < 0) return 1;
   }
 
-  rpa_queue_t **queues = (rpa_queue_t **)malloc(n_proc * sizeof(rpa_queue_t *));
-  pthread_t *threads = (pthread_t *)malloc(n_proc * sizeof(pthread_t));
+  // a thief is a second consumer, which the spsc ring doesn't allow, and
+  // the spsc ring has a single class
+  int queue_flags =
+      config.steal_ms || has_classes() ? RPA_QUEUE_POLLABLE : QUEUE_FLAGS;
+  if (config.queue_stats) queue_flags |= RPA_QUEUE_STATS;
+  uint32_t weights[N_CLASSES] = {config.critical_weight, 1};
 
   // start the threads
   for (int i = 0; i < n_proc; ++i) {
-    if (!rpa_queue_create(&queues[i], QUEUE_CAPACITY)) {
+    bool created =
+        has_classes()
+            ? conn_queue_create_prio(&slaves[i].queue, config.queue_capacity,
+                                     N_CLASSES,
+                                     config.critical_weight ? weights : NULL,
+                                     queue_flags)
+            : conn_queue_create(&slaves[i].queue, config.queue_capacity,
+                                queue_flags);
+    if (!created) {
       perror("Can't initialize a queue");
       return 1;
     }
 
-    int rc = pthread_create(&threads[i], NULL, slave, (void *)queues[i]);
+    int rc = start_slave(&slaves[i], slave);
     if (rc < 0) {
       perror("Can't create a thread");
       return 1;
     }
   }
 
+  // one set of batches per dispatcher, which only it touches
+  struct dispatch_batches batches = {NULL, NULL};
+  struct dispatch_batches critical_batches = {NULL, NULL};
+  if (dispatch_batches_init(&batches, n_proc) < 0 ||
+      (critical_fd >= 0 &&
+       dispatch_batches_init(&critical_batches, n_proc) < 0)) {
+    perror("Can't allocate the dispatch batches");
+    return 1;
+  }
+
   // main accept loop
-  while (!done) {
-    int s = accept(fd, (struct sockaddr *)&cli_addr, &cli_len);
-    if (s < 0) continue;
+  int cr = go(dispatcher(fd, CLASS_BULK, slaves, n_proc, &batches));
+  if (cr < 0) {
+    perror("Can't start a coroutine");
+    return 1;
+  }
 
-    if (!rpa_queue_push(queues[c_proc], (void *)(uintptr_t)(s))) {
-      perror("Can't push to a queue");
+  int critical_cr = -1;
+  if (critical_fd >= 0) {
+    critical_cr = go(dispatcher(critical_fd, CLASS_CRITICAL, slaves, n_proc,
+                                &critical_batches));
+    if (critical_cr < 0) {
+      perror("Can't start a coroutine");
       return 1;
     }
+  }
 
-    printf(">> New connection %d on thread %d\n", s, c_proc);
-
-    c_proc = (c_proc + 1 == n_proc ? 0 : c_proc + 1);
+  rc = fdin(shutdown_pipe[0], -1);
+  if (rc < 0) {
+    perror("Can't wait for shutdown");
+    return 1;
   }
 
+  hclose(cr);
+  if (critical_cr >= 0) hclose(critical_cr);
+  dispatch_batches_free(&batches);
+  dispatch_batches_free(&critical_batches);
+
   printf("\nClosing connections...\n");
 
   // signal an end to the threads
   for (int i = 0; i < n_proc; ++i) {
-    if (!rpa_queue_push(queues[i], (void *)-1)) {
+    if (!conn_queue_push(slaves[i].queue, &shutdown_msg, RPA_WAIT_FOREVER)) {
       perror("Can't push to a queue");
       return 1;
     }
@@ -300,16 +2252,22 @@ int main(int argc, char *argv[]) {
 
   // join the threads
   for (int i = 0; i < n_proc; ++i) {
-    int rc = pthread_join(threads[i], NULL);
+    int rc = pthread_join(slaves[i].thread, NULL);
     if (rc < 0) {
       perror("Can't join a thread");
       return 1;
     }
+    buf_pool_destroy(&slaves[i].pool);
+    static_cache_destroy(slaves[i].files);
     printf("Thread %d finished\n", i);
   }
 
-  // close the socket
+  log_shutdown();
+  resp_cache_destroy(resp_cache);
+
+  // close the sockets
   rc = close(fd);
+  if (rc == 0 && critical_fd >= 0) rc = close(critical_fd);
   if (rc < 0) {
     perror("Can't close the socket");
     return 1;
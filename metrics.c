@@ -0,0 +1,240 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rpa_queue.h"
+
+#define METRICS_PREFIX "playground_"
+
+static struct metrics *blocks;
+static int n_blocks;
+static __thread struct metrics *local;
+
+int metrics_init(int threads) {
+  blocks = aligned_alloc(RPA_CACHE_LINE, threads * sizeof(struct metrics));
+  if (!blocks) return -1;
+
+  for (int i = 0; i < threads; ++i) {
+    struct metrics *m = &blocks[i];
+    atomic_init(&m->accepted, 0);
+    atomic_init(&m->requests, 0);
+    atomic_init(&m->bytes_in, 0);
+    atomic_init(&m->bytes_out, 0);
+    atomic_init(&m->errors, 0);
+    for (int j = 0; j < METRICS_PHASES; ++j) atomic_init(&m->timeouts[j], 0);
+    atomic_init(&m->shed, 0);
+    atomic_init(&m->cache_hits, 0);
+    atomic_init(&m->cache_misses, 0);
+    hist_init(&m->accept_us);
+    hist_init(&m->parse_us);
+    hist_init(&m->request_us);
+  }
+  n_blocks = threads;
+
+  return 0;
+}
+
+void metrics_attach(int index) {
+  local = index >= 0 && index < n_blocks ? &blocks[index] : NULL;
+}
+
+struct metrics *metrics_local(void) {
+  return local;
+}
+
+uint64_t metrics_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+void metrics_record_dispatch(uint64_t accepted_us) {
+  if (!local || !accepted_us) return;
+  hist_record(&local->accept_us, metrics_now_us() - accepted_us);
+}
+
+struct out {
+  char *buf;
+  size_t len;
+  size_t used;
+};
+
+static void emit(struct out *out, const char *fmt, ...) {
+  if (out->used >= out->len) return;
+
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(out->buf + out->used, out->len - out->used, fmt, ap);
+  va_end(ap);
+
+  if (n < 0) return;
+  out->used += (size_t)n;
+  if (out->used > out->len) out->used = out->len;
+}
+
+static void emit_counter(struct out *out, const char *name, const char *help,
+                         uint64_t value) {
+  emit(out,
+       "# HELP " METRICS_PREFIX "%s %s\n"
+       "# TYPE " METRICS_PREFIX "%s counter\n" METRICS_PREFIX "%s %llu\n",
+       name, help, name, name, (unsigned long long)value);
+}
+
+static void emit_summary(struct out *out, const char *name, const char *help,
+                         const struct hist *h) {
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+  emit(out,
+       "# HELP " METRICS_PREFIX "%s %s\n"
+       "# TYPE " METRICS_PREFIX "%s summary\n",
+       name, help, name);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i)
+    emit(out, METRICS_PREFIX "%s{quantile=\"%g\"} %.6f\n", name, quantiles[i],
+         hist_percentile(h, quantiles[i]) / 1e6);
+  emit(out, METRICS_PREFIX "%s_sum %.6f\n", name, atomic_load(&h->sum) / 1e6);
+  emit(out, METRICS_PREFIX "%s_count %llu\n", name,
+       (unsigned long long)atomic_load(&h->count));
+}
+
+size_t metrics_render(char *buf, size_t len) {
+  struct metrics *sum = aligned_alloc(RPA_CACHE_LINE, sizeof(struct metrics));
+  if (!sum) return 0;
+
+  uint64_t accepted = 0, requests = 0, bytes_in = 0, bytes_out = 0;
+  uint64_t errors = 0, timeouts[METRICS_PHASES] = {0}, shed = 0;
+  uint64_t cache_hits = 0, cache_misses = 0;
+  hist_init(&sum->accept_us);
+  hist_init(&sum->parse_us);
+  hist_init(&sum->request_us);
+
+  for (int i = 0; i < n_blocks; ++i) {
+    struct metrics *m = &blocks[i];
+    accepted += atomic_load_explicit(&m->accepted, memory_order_relaxed);
+    requests += atomic_load_explicit(&m->requests, memory_order_relaxed);
+    bytes_in += atomic_load_explicit(&m->bytes_in, memory_order_relaxed);
+    bytes_out += atomic_load_explicit(&m->bytes_out, memory_order_relaxed);
+    errors += atomic_load_explicit(&m->errors, memory_order_relaxed);
+    for (int j = 0; j < METRICS_PHASES; ++j)
+      timeouts[j] +=
+          atomic_load_explicit(&m->timeouts[j], memory_order_relaxed);
+    shed += atomic_load_explicit(&m->shed, memory_order_relaxed);
+    cache_hits += atomic_load_explicit(&m->cache_hits, memory_order_relaxed);
+    cache_misses +=
+        atomic_load_explicit(&m->cache_misses, memory_order_relaxed);
+    hist_merge(&sum->accept_us, &m->accept_us);
+    hist_merge(&sum->parse_us, &m->parse_us);
+    hist_merge(&sum->request_us, &m->request_us);
+  }
+
+  struct out out = {buf, len, 0};
+  emit_counter(&out, "connections_accepted_total",
+               "Connections taken on by the slave threads.", accepted);
+  emit_counter(&out, "requests_total", "Requests served.", requests);
+  emit_counter(&out, "received_bytes_total",
+               "Request bytes received, headers approximated.", bytes_in);
+  emit_counter(&out, "sent_bytes_total",
+               "Response bytes sent, headers approximated.", bytes_out);
+  emit_counter(&out, "errors_total",
+               "Error responses and connections failed mid-request.", errors);
+  static const char *phases[METRICS_PHASES] = {"idle", "header", "body",
+                                               "write"};
+  emit(&out,
+       "# HELP " METRICS_PREFIX "timeouts_total Connections which timed out, "
+       "by what they were waiting for.\n"
+       "# TYPE " METRICS_PREFIX "timeouts_total counter\n");
+  for (int j = 0; j < METRICS_PHASES; ++j)
+    emit(&out, METRICS_PREFIX "timeouts_total{phase=\"%s\"} %llu\n",
+         phases[j], (unsigned long long)timeouts[j]);
+  emit_counter(&out, "connections_shed_total",
+               "Connections turned away because every slave was saturated.",
+               shed);
+  emit_counter(&out, "response_cache_hits_total",
+               "Requests answered from the response cache.", cache_hits);
+  emit_counter(&out, "response_cache_misses_total",
+               "Cacheable requests the response cache couldn't answer.",
+               cache_misses);
+  emit_summary(&out, "accept_dispatch_seconds",
+               "Time from accept() until a slave picks the connection up.",
+               &sum->accept_us);
+  emit_summary(&out, "parse_seconds",
+               "Time from the request line to the end of the headers.",
+               &sum->parse_us);
+  emit_summary(&out, "request_seconds",
+               "Time from the request line to the end of the response.",
+               &sum->request_us);
+
+  free(sum);
+  return out.used;
+}
+
+// rpa_queue_stats_t fields exported for every queue, nanoseconds as seconds
+static const struct {
+  const char *name;
+  const char *type;
+  const char *help;
+  size_t offset;
+  bool wide;
+  bool ns;
+} queue_fields[] = {
+#define QUEUE_FIELD(field, name, type, help, ns)                      \
+  {name, type, help, offsetof(rpa_queue_stats_t, field),              \
+   sizeof(((rpa_queue_stats_t *)0)->field) == sizeof(uint64_t), ns}
+    QUEUE_FIELD(pushes, "queue_pushes_total", "counter",
+                "Sockets pushed to a slave's queue.", false),
+    QUEUE_FIELD(pops, "queue_pops_total", "counter",
+                "Sockets popped by the queue's slave.", false),
+    QUEUE_FIELD(steals, "queue_steals_total", "counter",
+                "Sockets stolen from the queue by other slaves.", false),
+    QUEUE_FIELD(push_waits, "queue_push_waits_total", "counter",
+                "Times the dispatcher blocked on a full queue.", false),
+    QUEUE_FIELD(pop_waits, "queue_pop_waits_total", "counter",
+                "Times the slave blocked on an empty queue.", false),
+    QUEUE_FIELD(push_timeouts, "queue_push_timeouts_total", "counter",
+                "Pushes which ran into their deadline.", false),
+    QUEUE_FIELD(pop_timeouts, "queue_pop_timeouts_total", "counter",
+                "Pops which ran into their deadline.", false),
+    QUEUE_FIELD(push_wait_ns, "queue_push_wait_seconds_total", "counter",
+                "Time the dispatcher spent blocked on a full queue.", true),
+    QUEUE_FIELD(pop_wait_ns, "queue_pop_wait_seconds_total", "counter",
+                "Time the slave spent blocked on an empty queue.", true),
+    QUEUE_FIELD(contended, "queue_lock_contended_total", "counter",
+                "Queue lock acquisitions which found it taken.", false),
+    QUEUE_FIELD(high_water, "queue_high_water", "gauge",
+                "Most sockets ever queued at once.", false),
+    QUEUE_FIELD(size, "queue_size", "gauge", "Sockets queued right now.",
+                false),
+    QUEUE_FIELD(bounds, "queue_capacity", "gauge",
+                "Sockets the queue can hold.", false),
+#undef QUEUE_FIELD
+};
+
+size_t metrics_render_queues(char *buf, size_t len,
+                             const rpa_queue_stats_t *stats, int n) {
+  struct out out = {buf, len, 0};
+
+  for (size_t i = 0; i < sizeof(queue_fields) / sizeof(queue_fields[0]); ++i) {
+    emit(&out,
+         "# HELP " METRICS_PREFIX "%s %s\n"
+         "# TYPE " METRICS_PREFIX "%s %s\n",
+         queue_fields[i].name, queue_fields[i].help, queue_fields[i].name,
+         queue_fields[i].type);
+
+    for (int q = 0; q < n; ++q) {
+      const char *field = (const char *)&stats[q] + queue_fields[i].offset;
+      uint64_t value = queue_fields[i].wide ? *(const uint64_t *)field
+                                            : *(const uint32_t *)field;
+      if (queue_fields[i].ns)
+        emit(&out, METRICS_PREFIX "%s{queue=\"%d\"} %.6f\n",
+             queue_fields[i].name, q, value / 1e9);
+      else
+        emit(&out, METRICS_PREFIX "%s{queue=\"%d\"} %llu\n",
+             queue_fields[i].name, q, (unsigned long long)value);
+    }
+  }
+
+  return out.used;
+}
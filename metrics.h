@@ -0,0 +1,81 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache_line.h"
+#include "hist.h"
+
+// what a connection was waiting for when it timed out
+enum metrics_phase {
+  // the next request on a kept-alive connection
+  PHASE_IDLE,
+  // a request head, including the first one's first byte
+  PHASE_HEADER,
+  PHASE_BODY,
+  // the client to take the response
+  PHASE_WRITE,
+  METRICS_PHASES,
+};
+
+// Counters and latency histograms of one thread. Only the owning thread
+// writes to its block, and blocks are cache line aligned so that threads
+// never share a line; the blocks are only added up when they're read.
+struct metrics {
+  _Alignas(RPA_CACHE_LINE) _Atomic uint64_t accepted;
+  _Atomic uint64_t requests;
+  _Atomic uint64_t bytes_in;
+  _Atomic uint64_t bytes_out;
+  _Atomic uint64_t errors;
+  // connections reaped by a deadline, by phase
+  _Atomic uint64_t timeouts[METRICS_PHASES];
+  // connections turned away because every slave was saturated
+  _Atomic uint64_t shed;
+  // requests answered from the response cache, and those it couldn't answer
+  _Atomic uint64_t cache_hits;
+  _Atomic uint64_t cache_misses;
+  // microseconds from accept() until a slave picks the connection up
+  struct hist accept_us;
+  // microseconds from the request line to the end of the header block
+  struct hist parse_us;
+  // microseconds from the request line to the end of the response
+  struct hist request_us;
+};
+
+// sets up a block for each of the given number of threads
+int metrics_init(int threads);
+
+// makes the calling thread record into the given block
+void metrics_attach(int index);
+
+// the calling thread's block, which is where all of the recording goes
+struct metrics *metrics_local(void);
+
+// monotonic clock in microseconds
+uint64_t metrics_now_us(void);
+
+// adds to a counter of the calling thread's block
+static inline void metrics_add(_Atomic uint64_t *counter, uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+// records the time since a socket was accepted at metrics_now_us()
+// accepted_us in the calling thread, which has just picked the socket up
+void metrics_record_dispatch(uint64_t accepted_us);
+
+// renders all blocks added up in the Prometheus text format, returns the
+// length of the output which is truncated to fit len
+size_t metrics_render(char *buf, size_t len);
+
+struct rpa_queue_stats_t;
+
+// renders the counters of n queues like metrics_render(), labelled with
+// their index
+size_t metrics_render_queues(char *buf, size_t len,
+                             const struct rpa_queue_stats_t *stats, int n);
+
+#endif
@@ -0,0 +1,191 @@
+#include "resp_cache.h"
+
+#include <errno.h>
+#include <libdill.h>
+#include <stdlib.h>
+#include <string.h>
+
+// FNV-1a
+static uint64_t hash(const char *key, size_t len) {
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ (unsigned char)key[i]) * 1099511628211ull;
+  return h;
+}
+
+// the memory an entry is accounted for
+static size_t entry_size(const struct resp_entry *entry) {
+  return sizeof(*entry) + entry->key_len + entry->head_len + entry->body_len;
+}
+
+static struct resp_shard *shard_of(struct resp_cache *cache, uint64_t h) {
+  // the low bits pick the bucket within the shard
+  return &cache->shards[(h >> 32) % RESP_CACHE_SHARDS];
+}
+
+static struct resp_entry **bucket_of(struct resp_shard *shard, uint64_t h) {
+  return &shard->buckets[h % RESP_CACHE_SHARD_ENTRIES];
+}
+
+struct resp_cache *resp_cache_create(size_t max_bytes) {
+  struct resp_cache *cache = aligned_alloc(RPA_CACHE_LINE, sizeof(*cache));
+  if (!cache) return NULL;
+
+  cache->shard_cap = max_bytes / RESP_CACHE_SHARDS;
+  for (int i = 0; i < RESP_CACHE_SHARDS; ++i) {
+    struct resp_shard *shard = &cache->shards[i];
+    pthread_rwlock_init(&shard->lock, NULL);
+    shard->buckets = calloc(RESP_CACHE_SHARD_ENTRIES, sizeof(*shard->buckets));
+    shard->ring = calloc(RESP_CACHE_SHARD_ENTRIES, sizeof(*shard->ring));
+    shard->hand = 0;
+    shard->bytes = 0;
+    if (!shard->buckets || !shard->ring) {
+      // the shards up to this one, then this one
+      for (int j = 0; j <= i; ++j) {
+        free(cache->shards[j].buckets);
+        free(cache->shards[j].ring);
+        pthread_rwlock_destroy(&cache->shards[j].lock);
+      }
+      free(cache);
+      return NULL;
+    }
+  }
+
+  return cache;
+}
+
+void resp_cache_destroy(struct resp_cache *cache) {
+  if (!cache) return;
+
+  for (int i = 0; i < RESP_CACHE_SHARDS; ++i) {
+    struct resp_shard *shard = &cache->shards[i];
+    for (size_t j = 0; j < RESP_CACHE_SHARD_ENTRIES; ++j)
+      if (shard->ring[j]) resp_cache_release(shard->ring[j]);
+    free(shard->buckets);
+    free(shard->ring);
+    pthread_rwlock_destroy(&shard->lock);
+  }
+  free(cache);
+}
+
+struct resp_entry *resp_cache_get(struct resp_cache *cache, const char *key,
+                                  size_t key_len) {
+  uint64_t h = hash(key, key_len);
+  struct resp_shard *shard = shard_of(cache, h);
+  struct resp_entry *found = NULL;
+
+  pthread_rwlock_rdlock(&shard->lock);
+  for (struct resp_entry *e = *bucket_of(shard, h); e; e = e->next) {
+    if (e->hash == h && e->key_len == key_len &&
+        !memcmp(e->data, key, key_len)) {
+      // expired ones stay until an insert replaces or evicts them
+      if (e->expires_ms > now()) {
+        atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+        if (!atomic_load_explicit(&e->referenced, memory_order_relaxed))
+          atomic_store_explicit(&e->referenced, true, memory_order_relaxed);
+        found = e;
+      }
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+
+  return found;
+}
+
+struct resp_entry *resp_entry_create(const char *key, size_t key_len,
+                                     const char *head, size_t head_len,
+                                     size_t body_len, char **body) {
+  struct resp_entry *entry =
+      malloc(sizeof(*entry) + key_len + head_len + body_len);
+  if (!entry) return NULL;
+
+  entry->next = NULL;
+  entry->hash = hash(key, key_len);
+  entry->expires_ms = 0;
+  atomic_init(&entry->refs, 1);
+  atomic_init(&entry->referenced, false);
+  entry->ring_slot = 0;
+  entry->key_len = key_len;
+  entry->head_len = head_len;
+  entry->body_len = body_len;
+  memcpy(entry->data, key, key_len);
+  memcpy(entry->data + key_len, head, head_len);
+  *body = entry->data + key_len + head_len;
+
+  return entry;
+}
+
+// unlinks an entry from its shard and drops the shard's reference
+static void evict(struct resp_shard *shard, struct resp_entry *entry) {
+  struct resp_entry **link = bucket_of(shard, entry->hash);
+  while (*link != entry) link = &(*link)->next;
+  *link = entry->next;
+
+  shard->ring[entry->ring_slot] = NULL;
+  shard->bytes -= entry_size(entry);
+  resp_cache_release(entry);
+}
+
+// Advances the CLOCK hand to a slot for a new entry of size bytes, evicting
+// whatever wasn't referenced since the hand last passed it, and whatever
+// expired, until the shard has room. Two turns clear every reference bit.
+static size_t make_room(struct resp_shard *shard, size_t cap, size_t size) {
+  int64_t t = now();
+
+  for (size_t n = 0; n < 2 * RESP_CACHE_SHARD_ENTRIES + 1; ++n) {
+    size_t slot = shard->hand;
+    shard->hand = (shard->hand + 1) % RESP_CACHE_SHARD_ENTRIES;
+
+    struct resp_entry *e = shard->ring[slot];
+    if (e) {
+      bool referenced =
+          atomic_exchange_explicit(&e->referenced, false, memory_order_relaxed);
+      if (referenced && e->expires_ms > t) continue;
+      evict(shard, e);
+    }
+    if (shard->bytes + size <= cap) return slot;
+  }
+
+  // only reached if every slot was referenced twice during the sweep,
+  // which the write lock rules out
+  abort();
+}
+
+int resp_cache_insert(struct resp_cache *cache, struct resp_entry *entry,
+                      int64_t ttl_ms) {
+  size_t size = entry_size(entry);
+  if (size > cache->shard_cap) {
+    resp_cache_release(entry);
+    errno = E2BIG;
+    return -1;
+  }
+
+  struct resp_shard *shard = shard_of(cache, entry->hash);
+  entry->expires_ms = now() + ttl_ms;
+
+  pthread_rwlock_wrlock(&shard->lock);
+
+  struct resp_entry **bucket = bucket_of(shard, entry->hash);
+  for (struct resp_entry *e = *bucket; e; e = e->next) {
+    if (e->hash == entry->hash && e->key_len == entry->key_len &&
+        !memcmp(e->data, entry->data, entry->key_len)) {
+      evict(shard, e);
+      break;
+    }
+  }
+
+  entry->ring_slot = make_room(shard, cache->shard_cap, size);
+  shard->ring[entry->ring_slot] = entry;
+  entry->next = *bucket;
+  *bucket = entry;
+  shard->bytes += size;
+
+  pthread_rwlock_unlock(&shard->lock);
+  return 0;
+}
+
+void resp_cache_release(struct resp_entry *entry) {
+  if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) == 1)
+    free(entry);
+}
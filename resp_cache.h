@@ -0,0 +1,87 @@
+#ifndef RESP_CACHE_H
+#define RESP_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache_line.h"
+
+// shards of the cache, each with a lock of its own
+#define RESP_CACHE_SHARDS 16
+// responses a shard holds at most, whatever their size
+#define RESP_CACHE_SHARD_ENTRIES 1024
+
+// A cached response: its head without the Connection field and the final
+// empty line, which differ between connections, then its body. Entries are
+// immutable and reference counted, so they're sent without holding a lock.
+struct resp_entry {
+  struct resp_entry *next;
+  uint64_t hash;
+  int64_t expires_ms;
+  atomic_uint refs;
+  // CLOCK's reference bit, set by every hit
+  atomic_bool referenced;
+  size_t ring_slot;
+  size_t key_len;
+  size_t head_len;
+  size_t body_len;
+  // key, head, body
+  char data[];
+};
+
+struct resp_shard {
+  _Alignas(RPA_CACHE_LINE) pthread_rwlock_t lock;
+  // hash chains, RESP_CACHE_SHARD_ENTRIES of them
+  struct resp_entry **buckets;
+  // the CLOCK, with NULL in the free slots
+  struct resp_entry **ring;
+  size_t hand;
+  size_t bytes;
+};
+
+// A response cache shared by all threads, with entries spread over shards
+// by the hash of their key. Lookups only take a shard's read lock; inserts
+// take its write lock and evict with CLOCK until the shard's share of the
+// memory cap is respected.
+struct resp_cache {
+  size_t shard_cap;
+  struct resp_shard shards[RESP_CACHE_SHARDS];
+};
+
+// creates a cache of at most max_bytes, NULL if out of memory
+struct resp_cache *resp_cache_create(size_t max_bytes);
+
+// frees the cache, entries still referenced stay valid
+void resp_cache_destroy(struct resp_cache *cache);
+
+// Returns a reference to the unexpired entry of key, NULL if there isn't
+// one. The reference is dropped with resp_cache_release().
+struct resp_entry *resp_cache_get(struct resp_cache *cache, const char *key,
+                                  size_t key_len);
+
+// Creates an entry to be inserted, with room for a body of body_len bytes
+// at *body for the caller to fill in. NULL if out of memory.
+struct resp_entry *resp_entry_create(const char *key, size_t key_len,
+                                     const char *head, size_t head_len,
+                                     size_t body_len, char **body);
+
+// Caches an entry for ttl_ms, replacing any of the same key, and takes the
+// caller's reference. Returns -1 with errno set to E2BIG if it is larger
+// than a shard's share of the memory cap, which drops it.
+int resp_cache_insert(struct resp_cache *cache, struct resp_entry *entry,
+                      int64_t ttl_ms);
+
+void resp_cache_release(struct resp_entry *entry);
+
+static inline const char *resp_entry_head(const struct resp_entry *entry) {
+  return entry->data + entry->key_len;
+}
+
+static inline const char *resp_entry_body(const struct resp_entry *entry) {
+  return entry->data + entry->key_len + entry->head_len;
+}
+
+#endif
@@ -15,18 +15,30 @@
  */
 
 #include "rpa_queue.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
+#if defined __linux__
+#include <sys/eventfd.h>
+#endif
+
+#ifdef RPA_QUEUE_FUTEX
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 // uncomment to print debug messages
 // #define QUEUE_DEBUG
 
 #ifdef QUEUE_DEBUG
 static void Q_DBG(const char*msg, rpa_queue_t *q) {
   fprintf(stderr, "#%d in %d out %d\t%s\n",
-          q->nelts, q->in, q->out,
+          q->nelts, q->classes[0].in, q->classes[0].out,
           msg
           );
 }
@@ -35,30 +47,775 @@ static void Q_DBG(const char*msg, rpa_queue_t *q) {
 #endif
 
 /**
- * Detects when the rpa_queue_t is full. This utility function is expected
+ * Detects when a priority class of the rpa_queue_t is full. This utility
+ * function is expected to be called from within critical sections, and is
+ * not threadsafe.
+ */
+#define rpa_queue_class_full(queue, c) ((c)->nelts == (queue)->class_bounds)
+
+/**
+ * Detects when the rpa_queue_t is empty. This utility function is expected
  * to be called from within critical sections, and is not threadsafe.
  */
-#define rpa_queue_full(queue) ((queue)->nelts == (queue)->bounds)
+#define rpa_queue_empty(queue) ((queue)->nelts == 0)
+
+static void set_timeout(struct timespec * abstime, int wait_ms)
+{
+  clock_gettime(CLOCK_REALTIME, abstime);
+  /* add seconds */
+  abstime->tv_sec += (wait_ms / 1000);
+  /* add and carry microseconds */
+  long ms = abstime->tv_nsec / 1000000L;
+  ms += wait_ms % 1000;
+  while (ms > 1000) {
+    ms -= 1000;
+    abstime->tv_sec += 1;
+  }
+  abstime->tv_nsec = ms * 1000000L;
+}
+
+/**
+ * Makes the queue's descriptor readable. A full eventfd counter or pipe
+ * means it is readable already, so EAGAIN is not an error.
+ */
+static void rpa_queue_notify(rpa_queue_t *queue)
+{
+#if defined __linux__
+  uint64_t one = 1;
+#else
+  char one = 1;
+#endif
+  ssize_t rv;
+
+  do {
+    rv = write(queue->event_fd[1], &one, sizeof(one));
+  } while (rv < 0 && errno == EINTR);
+}
+
+/**
+ * Resets the queue's descriptor to not readable.
+ */
+static void rpa_queue_drain(rpa_queue_t *queue)
+{
+  char buf[64];
+  ssize_t rv;
+
+  do {
+    rv = read(queue->event_fd[0], buf, sizeof(buf));
+  } while (rv > 0 || (rv < 0 && errno == EINTR));
+}
+
+static inline void rpa_cpu_relax(void)
+{
+#if defined __x86_64__ || defined __i386__
+  __builtin_ia32_pause();
+#elif defined __aarch64__
+  __asm__ __volatile__("yield");
+#endif
+}
+
+#ifdef RPA_QUEUE_FUTEX
+
+#if !defined __linux__
+#error "RPA_QUEUE_FUTEX needs Linux futexes"
+#endif
+
+/**
+ * Futex backend. The mutex is the classic three state futex lock (0 free,
+ * 1 locked, 2 locked with sleepers) so that unlocking only enters the kernel
+ * when somebody sleeps, and it spins for a while before sleeping. The spin
+ * limit adapts to how long the lock usually takes to come free, like glibc's
+ * PTHREAD_MUTEX_ADAPTIVE_NP. A condition variable is a sequence number
+ * waited on with the mutex released; signalling bumps it and only calls
+ * into the kernel while the waiter count (kept under the mutex) is non-zero.
+ */
+#define RPA_FUTEX_SPIN_MAX 100
+#define RPA_COND_SPIN 64
+
+/**
+ * Spinning only makes sense while the other side runs on another cpu.
+ */
+static int rpa_spin_limit(int limit)
+{
+  static atomic_int cpus;
+  int n = atomic_load_explicit(&cpus, memory_order_relaxed);
+
+  if (n == 0) {
+    n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    atomic_store_explicit(&cpus, n, memory_order_relaxed);
+  }
+  return n > 1 ? limit : 0;
+}
+
+static int rpa_futex_wait(atomic_uint *addr, unsigned expected,
+                          const struct timespec *abstime)
+{
+  if (abstime) {
+    return syscall(SYS_futex, addr,
+                   FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+                   expected, abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+  }
+  return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL,
+                 0);
+}
+
+static void rpa_futex_wake(atomic_uint *addr, int n)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static int rpa_mutex_init(rpa_mutex_t *m)
+{
+  atomic_init(&m->state, 0);
+  atomic_init(&m->spins, 0);
+  return 0;
+}
+
+static void rpa_mutex_destroy(rpa_mutex_t *m)
+{
+  (void)m;
+}
+
+static int rpa_mutex_trylock(rpa_mutex_t *m)
+{
+  unsigned c = 0;
+  return atomic_compare_exchange_strong_explicit(
+             &m->state, &c, 1, memory_order_acquire, memory_order_relaxed)
+             ? 0
+             : EBUSY;
+}
+
+static int rpa_mutex_lock(rpa_mutex_t *m)
+{
+  unsigned c = 0;
+  if (atomic_compare_exchange_strong_explicit(
+          &m->state, &c, 1, memory_order_acquire, memory_order_relaxed)) {
+    return 0;
+  }
+
+  int spins = atomic_load_explicit(&m->spins, memory_order_relaxed);
+  int limit = rpa_spin_limit(spins * 2 + 10 < RPA_FUTEX_SPIN_MAX
+                                 ? spins * 2 + 10
+                                 : RPA_FUTEX_SPIN_MAX);
+  for (int i = 0; i < limit; ++i) {
+    rpa_cpu_relax();
+    c = 0;
+    if (atomic_load_explicit(&m->state, memory_order_relaxed) == 0 &&
+        atomic_compare_exchange_strong_explicit(
+            &m->state, &c, 1, memory_order_acquire, memory_order_relaxed)) {
+      atomic_store_explicit(&m->spins, spins + (i - spins) / 8,
+                            memory_order_relaxed);
+      return 0;
+    }
+  }
+  if (limit) {
+    atomic_store_explicit(&m->spins, spins + (limit - spins) / 8,
+                          memory_order_relaxed);
+  }
+
+  /* mark the lock contended so that its owner wakes us when done */
+  c = atomic_exchange_explicit(&m->state, 2, memory_order_acquire);
+  while (c != 0) {
+    rpa_futex_wait(&m->state, 2, NULL);
+    c = atomic_exchange_explicit(&m->state, 2, memory_order_acquire);
+  }
+  return 0;
+}
+
+static int rpa_mutex_unlock(rpa_mutex_t *m)
+{
+  if (atomic_fetch_sub_explicit(&m->state, 1, memory_order_release) != 1) {
+    atomic_store_explicit(&m->state, 0, memory_order_release);
+    rpa_futex_wake(&m->state, 1);
+  }
+  return 0;
+}
+
+static int rpa_cond_init(rpa_cond_t *c)
+{
+  atomic_init(&c->seq, 0);
+  atomic_init(&c->waiters, 0);
+  return 0;
+}
+
+static void rpa_cond_destroy(rpa_cond_t *c)
+{
+  (void)c;
+}
+
+static int rpa_cond_timedwait(rpa_cond_t *c, rpa_mutex_t *m,
+                              const struct timespec *abstime)
+{
+  unsigned seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+  int rv = 0;
+
+  atomic_fetch_add_explicit(&c->waiters, 1, memory_order_relaxed);
+  rpa_mutex_unlock(m);
+
+  /* a signal that comes in before we sleep changes seq, making the futex
+   * wait return straight away */
+  int spin = rpa_spin_limit(RPA_COND_SPIN);
+  int i = 0;
+  while (atomic_load_explicit(&c->seq, memory_order_acquire) == seq) {
+    if (i++ < spin) {
+      rpa_cpu_relax();
+      continue;
+    }
+    if (rpa_futex_wait(&c->seq, seq, abstime) < 0 && errno == ETIMEDOUT) {
+      rv = ETIMEDOUT;
+      break;
+    }
+    /* EINTR and EAGAIN are spurious wakeups, which callers cope with */
+    break;
+  }
+
+  /* awake already, so leave before queueing up for the mutex, or signals
+   * sent meanwhile would make pointless wake calls */
+  atomic_fetch_sub_explicit(&c->waiters, 1, memory_order_relaxed);
+  rpa_mutex_lock(m);
+  return rv;
+}
+
+static int rpa_cond_wait(rpa_cond_t *c, rpa_mutex_t *m)
+{
+  return rpa_cond_timedwait(c, m, NULL);
+}
+
+/* must be called with the mutex held, which all callers do */
+static int rpa_cond_signal(rpa_cond_t *c)
+{
+  if (atomic_load_explicit(&c->waiters, memory_order_relaxed)) {
+    atomic_fetch_add_explicit(&c->seq, 1, memory_order_release);
+    rpa_futex_wake(&c->seq, 1);
+  }
+  return 0;
+}
+
+static int rpa_cond_broadcast(rpa_cond_t *c)
+{
+  if (atomic_load_explicit(&c->waiters, memory_order_relaxed)) {
+    atomic_fetch_add_explicit(&c->seq, 1, memory_order_release);
+    rpa_futex_wake(&c->seq, INT_MAX);
+  }
+  return 0;
+}
+
+#else
+
+/**
+ * pthread backend.
+ */
+static int rpa_mutex_init(rpa_mutex_t *m)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  int rv = pthread_mutex_init(m, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return rv;
+}
+
+#define rpa_mutex_destroy(m) pthread_mutex_destroy(m)
+#define rpa_mutex_trylock(m) pthread_mutex_trylock(m)
+#define rpa_mutex_lock(m) pthread_mutex_lock(m)
+#define rpa_mutex_unlock(m) pthread_mutex_unlock(m)
+#define rpa_cond_init(c) pthread_cond_init(c, NULL)
+#define rpa_cond_destroy(c) pthread_cond_destroy(c)
+#define rpa_cond_wait(c, m) pthread_cond_wait(c, m)
+#define rpa_cond_timedwait(c, m, t) pthread_cond_timedwait(c, m, t)
+#define rpa_cond_signal(c) pthread_cond_signal(c)
+#define rpa_cond_broadcast(c) pthread_cond_broadcast(c)
+
+#endif /* RPA_QUEUE_FUTEX */
+
+/**
+ * Counters of a RPA_QUEUE_STATS queue. The producer and consumer sides are
+ * on separate cache lines so that a spsc ring's two threads don't share one
+ * because of them. Updates are relaxed atomic adds, which are cheap next to
+ * the locking and waking they count.
+ */
+struct rpa_queue_counters {
+  _Alignas(RPA_CACHE_LINE) atomic_uint_fast64_t pushes;
+  atomic_uint_fast64_t push_waits;
+  atomic_uint_fast64_t push_timeouts;
+  atomic_uint_fast64_t push_wait_ns;
+  atomic_uint high_water;
+  _Alignas(RPA_CACHE_LINE) atomic_uint_fast64_t pops;
+  atomic_uint_fast64_t steals;
+  atomic_uint_fast64_t pop_waits;
+  atomic_uint_fast64_t pop_timeouts;
+  atomic_uint_fast64_t pop_wait_ns;
+  _Alignas(RPA_CACHE_LINE) atomic_uint_fast64_t contended;
+};
+
+#ifndef RPA_QUEUE_NO_STATS
+#define RPA_STAT_ADD(queue, field, n)                                   \
+  do {                                                                  \
+    if ((queue)->stats)                                                 \
+      atomic_fetch_add_explicit(&(queue)->stats->field, (n),            \
+                                memory_order_relaxed);                  \
+  } while (0)
+#else
+#define RPA_STAT_ADD(queue, field, n) ((void)0)
+#endif
+
+/**
+ * Monotonic clock read before a wait, 0 if the queue doesn't keep stats.
+ */
+static inline uint64_t rpa_stat_clock(rpa_queue_t *queue)
+{
+#ifndef RPA_QUEUE_NO_STATS
+  if (queue->stats) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+  }
+#endif
+  return 0;
+}
+
+/**
+ * Accounts for a wait which started at 'since' (see rpa_stat_clock()).
+ */
+static inline void rpa_stat_waited(rpa_queue_t *queue, bool pushing,
+                                   uint64_t since, bool timedout)
+{
+#ifndef RPA_QUEUE_NO_STATS
+  if (!queue->stats) {
+    return;
+  }
+  uint64_t waited = rpa_stat_clock(queue) - since;
+  if (pushing) {
+    RPA_STAT_ADD(queue, push_waits, 1);
+    RPA_STAT_ADD(queue, push_wait_ns, waited);
+    if (timedout) RPA_STAT_ADD(queue, push_timeouts, 1);
+  } else {
+    RPA_STAT_ADD(queue, pop_waits, 1);
+    RPA_STAT_ADD(queue, pop_wait_ns, waited);
+    if (timedout) RPA_STAT_ADD(queue, pop_timeouts, 1);
+  }
+#endif
+}
+
+/**
+ * Raises the high-water mark. Only ever called by one thread at a time: the
+ * spsc producer, or whoever holds one_big_mutex.
+ */
+static inline void rpa_stat_size(rpa_queue_t *queue, uint32_t size)
+{
+#ifndef RPA_QUEUE_NO_STATS
+  if (queue->stats && size > atomic_load_explicit(&queue->stats->high_water,
+                                                  memory_order_relaxed)) {
+    atomic_store_explicit(&queue->stats->high_water, size,
+                          memory_order_relaxed);
+  }
+#endif
+}
+
+/**
+ * Takes one_big_mutex, counting the times somebody else had it.
+ */
+static inline int rpa_queue_lock(rpa_queue_t *queue)
+{
+#ifndef RPA_QUEUE_NO_STATS
+  if (queue->stats) {
+    int rv = rpa_mutex_trylock(&queue->one_big_mutex);
+    if (rv != EBUSY) {
+      return rv;
+    }
+    RPA_STAT_ADD(queue, contended, 1);
+  }
+#endif
+  return rpa_mutex_lock(&queue->one_big_mutex);
+}
+
+/**
+ * Waits once on 'cond' as one of 'waiters'. Must be called within the
+ * critical section.
+ */
+static bool rpa_queue_wait_locked(rpa_queue_t *queue, rpa_cond_t *cond,
+                                  uint32_t *waiters, int wait_ms)
+{
+  uint64_t since = rpa_stat_clock(queue);
+  int rv;
+
+  (*waiters)++;
+  if (wait_ms == RPA_WAIT_FOREVER) {
+    rv = rpa_cond_wait(cond, &queue->one_big_mutex);
+  } else {
+    struct timespec abstime;
+    set_timeout(&abstime, wait_ms);
+    rv = rpa_cond_timedwait(cond, &queue->one_big_mutex, &abstime);
+  }
+  (*waiters)--;
+  rpa_stat_waited(queue, cond == &queue->not_full, since, rv == ETIMEDOUT);
+
+  return rv == 0;
+}
+
+/**
+ * Address of slot i of the ring.
+ */
+static inline unsigned char *rpa_queue_slot(rpa_queue_t *queue, uint32_t i)
+{
+  return queue->data + (size_t)i * queue->elt_size;
+}
+
+/**
+ * Copies a single element; a pointer sized copy is inlined into a plain move.
+ */
+static inline void rpa_queue_copy(rpa_queue_t *queue, void *dst,
+                                  const void *src)
+{
+  if (queue->elt_size == sizeof(void *)) {
+    memcpy(dst, src, sizeof(void *));
+  } else {
+    memcpy(dst, src, queue->elt_size);
+  }
+}
+
+/**
+ * Copies n elements into the ring of 'bounds' slots starting at slot 'base',
+ * from its slot i on, in at most two pieces around the wrap point.
+ */
+static void rpa_queue_ring_write(rpa_queue_t *queue, uint32_t base,
+                                 uint32_t bounds, uint32_t i,
+                                 const void *items, uint32_t n)
+{
+  uint32_t first = bounds - i < n ? bounds - i : n;
+  size_t split = (size_t)first * queue->elt_size;
+
+  memcpy(rpa_queue_slot(queue, base + i), items, split);
+  memcpy(rpa_queue_slot(queue, base), (const unsigned char *)items + split,
+         (size_t)(n - first) * queue->elt_size);
+}
+
+/**
+ * Copies n elements out of the ring of 'bounds' slots starting at slot
+ * 'base', from its slot i on, in at most two pieces around the wrap point.
+ */
+static void rpa_queue_ring_read(rpa_queue_t *queue, uint32_t base,
+                                uint32_t bounds, uint32_t i, void *out,
+                                uint32_t n)
+{
+  uint32_t first = bounds - i < n ? bounds - i : n;
+  size_t split = (size_t)first * queue->elt_size;
+
+  memcpy(out, rpa_queue_slot(queue, base + i), split);
+  memcpy((unsigned char *)out + split, rpa_queue_slot(queue, base),
+         (size_t)(n - first) * queue->elt_size);
+}
+
+/**
+ * Picks the class the next pop takes from: the most urgent non-empty one
+ * with strict priority, otherwise the most urgent non-empty one which has
+ * credit left in the current round, starting a new round when none has.
+ * Must be called within the critical section with elements queued.
+ */
+static struct rpa_queue_class *rpa_queue_next_class(rpa_queue_t *queue)
+{
+  struct rpa_queue_class *c = queue->classes;
+  struct rpa_queue_class *end = c + queue->n_classes;
+
+  if (queue->n_classes == 1) {
+    return c;
+  }
+  if (c->weight == 0) {
+    while (c->nelts == 0) c++;
+    return c;
+  }
+
+  for (int round = 0; round < 2; ++round) {
+    for (c = queue->classes; c < end; ++c) {
+      if (c->nelts && c->credit) return c;
+    }
+    for (c = queue->classes; c < end; ++c) c->credit = c->weight;
+  }
+  /* not reached, every class had credit in the new round */
+  return queue->classes;
+}
+
+/**
+ * Copies n items into a class. Must be called within the critical section
+ * with room for n items.
+ */
+static void rpa_queue_put_locked(rpa_queue_t *queue, struct rpa_queue_class *c,
+                                 const void *items, uint32_t n)
+{
+  if (n == 1) {
+    rpa_queue_copy(queue, rpa_queue_slot(queue, c->base + c->in), items);
+  } else {
+    rpa_queue_ring_write(queue, c->base, queue->class_bounds, c->in, items, n);
+  }
+
+  c->in += n;
+  if (c->in >= queue->class_bounds) {
+    c->in -= queue->class_bounds;
+  }
+  c->nelts += n;
+  queue->nelts += n;
+  RPA_STAT_ADD(queue, pushes, n);
+  rpa_stat_size(queue, queue->nelts);
+}
+
+/**
+ * Copies n items out of the ring, class by class in the order of
+ * rpa_queue_next_class(). Must be called within the critical section with
+ * n items queued.
+ */
+static void rpa_queue_take_locked(rpa_queue_t *queue, void *out, uint32_t n)
+{
+  for (uint32_t done = 0, k; done < n; done += k) {
+    struct rpa_queue_class *c = rpa_queue_next_class(queue);
+    void *dst = (unsigned char *)out + (size_t)done * queue->elt_size;
+
+    k = n - done < c->nelts ? n - done : c->nelts;
+    if (c->weight) {
+      if (k > c->credit) k = c->credit;
+      c->credit -= k;
+    }
+
+    if (k == 1) {
+      rpa_queue_copy(queue, dst, rpa_queue_slot(queue, c->base + c->out));
+    } else {
+      rpa_queue_ring_read(queue, c->base, queue->class_bounds, c->out, dst, k);
+    }
+
+    c->out += k;
+    if (c->out >= queue->class_bounds) {
+      c->out -= queue->class_bounds;
+    }
+    c->nelts -= k;
+  }
+
+  queue->nelts -= n;
+  RPA_STAT_ADD(queue, pops, n);
+}
+
+/**
+ * Wakes producers waiting for room after n items were taken. One of them
+ * is enough for a single item, unless they may be waiting on different
+ * classes. Must be called within the critical section.
+ */
+static void rpa_queue_wake_pushers(rpa_queue_t *queue, uint32_t n)
+{
+  if (queue->full_waiters) {
+    Q_DBG("signal !full", queue);
+    if (n > 1 || queue->n_classes > 1) {
+      rpa_cond_broadcast(&queue->not_full);
+    } else {
+      rpa_cond_signal(&queue->not_full);
+    }
+  }
+}
+
+/**
+ * Single producer/consumer ring (RPA_QUEUE_SPSC).
+ *
+ * 'tail' is only written by the producer and 'head' only by the consumer, so
+ * the fast paths are a pair of acquire/release operations. A side which finds
+ * the ring full/empty spins for RPA_SPSC_SPIN rounds and then parks: it bumps
+ * its *_parked counter under one_big_mutex and re-checks the ring before
+ * sleeping, while the other side publishes its index and then looks at the
+ * counter, both with sequentially consistent ordering. Either the sleeper sees
+ * the new index or the waker sees the sleeper, so the mutex and the condvar
+ * syscalls are only touched when somebody is actually asleep.
+ */
+#define RPA_SPSC_SPIN 256
+
+static inline uint32_t spsc_size(rpa_queue_t *queue)
+{
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  return tail - head;
+}
+
+static bool spsc_ready(rpa_queue_t *queue, bool pushing)
+{
+  uint32_t size = spsc_size(queue);
+  return pushing ? size != queue->bounds : size != 0;
+}
+
+static void spsc_wake(rpa_queue_t *queue, bool consumer)
+{
+  atomic_uint *parked = consumer ? &queue->pop_parked : &queue->push_parked;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(parked, memory_order_relaxed) == 0) {
+    return;
+  }
+
+  rpa_queue_lock(queue);
+  if (consumer) {
+    Q_DBG("sig !empty", queue);
+    rpa_cond_signal(&queue->not_empty);
+    if (queue->fd_waiters) {
+      rpa_queue_notify(queue);
+    }
+  } else {
+    Q_DBG("signal !full", queue);
+    rpa_cond_signal(&queue->not_full);
+  }
+  rpa_mutex_unlock(&queue->one_big_mutex);
+}
+
+/**
+ * Parks the calling side until the ring is ready for it, the queue is
+ * terminated or the deadline (if any) has passed.
+ */
+static bool spsc_park(rpa_queue_t *queue, bool pushing,
+                      const struct timespec *abstime)
+{
+  atomic_uint *parked = pushing ? &queue->push_parked : &queue->pop_parked;
+  rpa_cond_t *cond = pushing ? &queue->not_full : &queue->not_empty;
+  uint64_t since = rpa_stat_clock(queue);
+  int rv = 0;
+
+  rpa_queue_lock(queue);
+  atomic_fetch_add(parked, 1);
+  while (rv == 0 && !spsc_ready(queue, pushing) && !queue->terminated) {
+    if (abstime) {
+      rv = rpa_cond_timedwait(cond, &queue->one_big_mutex, abstime);
+    } else {
+      rv = rpa_cond_wait(cond, &queue->one_big_mutex);
+    }
+  }
+  atomic_fetch_sub(parked, 1);
+  rpa_mutex_unlock(&queue->one_big_mutex);
+
+  rpa_stat_waited(queue, pushing, since, rv == ETIMEDOUT);
+  return rv == 0 && !queue->terminated;
+}
+
+static uint32_t spsc_trypush_batch(rpa_queue_t *queue, const void *items,
+                                   uint32_t n)
+{
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  uint32_t room = queue->bounds - (tail - head);
+
+  if (n > room) n = room;
+  if (n == 0) {
+    return 0;
+  }
+
+  rpa_queue_ring_write(queue, 0, queue->bounds, tail & queue->mask, items, n);
+  atomic_store_explicit(&queue->tail, tail + n, memory_order_release);
+  RPA_STAT_ADD(queue, pushes, n);
+  rpa_stat_size(queue, tail + n - head);
+
+  spsc_wake(queue, true);
+  return n;
+}
+
+static uint32_t spsc_trypop_batch(rpa_queue_t *queue, void *out,
+                                  uint32_t max)
+{
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  uint32_t n = tail - head;
+
+  if (n > max) n = max;
+  if (n == 0) {
+    return 0;
+  }
+
+  rpa_queue_ring_read(queue, 0, queue->bounds, head & queue->mask, out, n);
+  atomic_store_explicit(&queue->head, head + n, memory_order_release);
+  RPA_STAT_ADD(queue, pops, n);
+
+  spsc_wake(queue, false);
+  return n;
+}
+
+static uint32_t spsc_timedpush_batch(rpa_queue_t *queue, const void *items,
+                                     uint32_t n, int wait_ms)
+{
+  struct timespec abstime;
+  uint32_t rv;
+
+  for (int i = 0; i < RPA_SPSC_SPIN; ++i) {
+    if (queue->terminated) return 0;
+    if ((rv = spsc_trypush_batch(queue, items, n))) return rv;
+    rpa_cpu_relax();
+  }
+
+  if (wait_ms != RPA_WAIT_FOREVER) set_timeout(&abstime, wait_ms);
+
+  while (!(rv = spsc_trypush_batch(queue, items, n))) {
+    if (!spsc_park(queue, true,
+                   wait_ms == RPA_WAIT_FOREVER ? NULL : &abstime)) {
+      return 0;
+    }
+  }
+  return rv;
+}
+
+static uint32_t spsc_timedpop_batch(rpa_queue_t *queue, void *out,
+                                    uint32_t max, int wait_ms)
+{
+  struct timespec abstime;
+  uint32_t rv;
+
+  for (int i = 0; i < RPA_SPSC_SPIN; ++i) {
+    if (queue->terminated) return 0;
+    if ((rv = spsc_trypop_batch(queue, out, max))) return rv;
+    rpa_cpu_relax();
+  }
 
-/**
- * Detects when the rpa_queue_t is empty. This utility function is expected
- * to be called from within critical sections, and is not threadsafe.
- */
-#define rpa_queue_empty(queue) ((queue)->nelts == 0)
+  if (wait_ms != RPA_WAIT_FOREVER) set_timeout(&abstime, wait_ms);
 
-static void set_timeout(struct timespec * abstime, int wait_ms)
+  while (!(rv = spsc_trypop_batch(queue, out, max))) {
+    if (!spsc_park(queue, false,
+                   wait_ms == RPA_WAIT_FOREVER ? NULL : &abstime)) {
+      return 0;
+    }
+  }
+  return rv;
+}
+
+static uint32_t spsc_fdpop_batch(rpa_queue_t *queue, void *out, uint32_t max,
+                                 rpa_queue_fdwait_t wait, int64_t deadline)
 {
-  clock_gettime(CLOCK_REALTIME, abstime);
-  /* add seconds */
-  abstime->tv_sec += (wait_ms / 1000);
-  /* add and carry microseconds */
-  long ms = abstime->tv_nsec / 1000000L;
-  ms += wait_ms % 1000;
-  while (ms > 1000) {
-    ms -= 1000;
-    abstime->tv_sec += 1;
+  uint32_t n;
+
+  for (int i = 0; i < RPA_SPSC_SPIN; ++i) {
+    if (queue->terminated) return 0;
+    if ((n = spsc_trypop_batch(queue, out, max))) return n;
+    rpa_cpu_relax();
   }
-  abstime->tv_nsec = ms * 1000000L;
+
+  while (!(n = spsc_trypop_batch(queue, out, max))) {
+    if (queue->terminated) {
+      return 0;
+    }
+
+    rpa_queue_lock(queue);
+    queue->fd_waiters++;
+    atomic_fetch_add(&queue->pop_parked, 1);
+    bool ready = spsc_ready(queue, false) || queue->terminated;
+    rpa_mutex_unlock(&queue->one_big_mutex);
+
+    uint64_t since = rpa_stat_clock(queue);
+    int rv = ready ? 0 : wait(queue->event_fd[0], deadline);
+    int err = errno;
+    if (!ready) {
+      rpa_stat_waited(queue, false, since, rv < 0 && err == ETIMEDOUT);
+    }
+
+    rpa_queue_lock(queue);
+    atomic_fetch_sub(&queue->pop_parked, 1);
+    if (--queue->fd_waiters == 0) {
+      rpa_queue_drain(queue);
+    }
+    rpa_mutex_unlock(&queue->one_big_mutex);
+
+    if (rv < 0) {
+      errno = err;
+      return 0;
+    }
+  }
+  return n;
 }
 
 /**
@@ -68,58 +825,162 @@ static void set_timeout(struct timespec * abstime, int wait_ms)
 void rpa_queue_destroy(rpa_queue_t * queue)
 {
   /* Ignore errors here, we can't do anything about them anyway. */
-  pthread_cond_destroy(queue->not_empty);
-  pthread_cond_destroy(queue->not_full);
-  pthread_mutex_destroy(queue->one_big_mutex);
+  rpa_cond_destroy(&queue->not_empty);
+  rpa_cond_destroy(&queue->not_full);
+  rpa_mutex_destroy(&queue->one_big_mutex);
+
+  if (queue->event_fd[0] >= 0) close(queue->event_fd[0]);
+  if (queue->event_fd[1] >= 0 && queue->event_fd[1] != queue->event_fd[0])
+    close(queue->event_fd[1]);
+
+  free(queue->stats);
 }
 
 /**
  * Initialize the rpa_queue_t.
  */
 bool rpa_queue_create(rpa_queue_t **q, uint32_t queue_capacity)
+{
+  return rpa_queue_create_ex(q, queue_capacity, 0);
+}
+
+/**
+ * Initialize a rpa_queue_t which can be waited on with rpa_queue_fdpop().
+ */
+bool rpa_queue_create_pollable(rpa_queue_t **q, uint32_t queue_capacity)
+{
+  return rpa_queue_create_ex(q, queue_capacity, RPA_QUEUE_POLLABLE);
+}
+
+bool rpa_queue_create_ex(rpa_queue_t **q, uint32_t queue_capacity, int flags)
+{
+  return rpa_queue_create_elt(q, queue_capacity, sizeof(void *), flags);
+}
+
+bool rpa_queue_create_elt(rpa_queue_t **q, uint32_t queue_capacity,
+                          size_t elt_size, int flags)
+{
+  return rpa_queue_create_prio(q, queue_capacity, elt_size, 1, NULL, flags);
+}
+
+bool rpa_queue_create_prio(rpa_queue_t **q, uint32_t queue_capacity,
+                           size_t elt_size, uint32_t n_classes,
+                           const uint32_t *weights, int flags)
 {
   rpa_queue_t *queue;
-  queue = malloc(sizeof(rpa_queue_t));
-  if (!queue) {
+  uint32_t mask = 0;
+
+  if (elt_size == 0 || elt_size > UINT32_MAX || n_classes == 0 ||
+      n_classes > RPA_QUEUE_MAX_CLASSES ||
+      ((flags & RPA_QUEUE_SPSC) && n_classes > 1) ||
+      (uint64_t)queue_capacity * n_classes > UINT32_MAX) {
+    errno = EINVAL;
+    return false;
+  }
+  for (uint32_t i = 0; weights && i < n_classes; ++i) {
+    if (weights[i] == 0) {
+      errno = EINVAL;
+      return false;
+    }
+  }
+
+  if (flags & RPA_QUEUE_SPSC) {
+    /* round up to a power of two so indices can be masked, which past
+     * 2^31 wouldn't fit in 32 bits */
+    if (queue_capacity > (1u << 31)) {
+      errno = EINVAL;
+      return false;
+    }
+    uint32_t bounds = 1;
+    while (bounds < queue_capacity) bounds <<= 1;
+    queue_capacity = bounds;
+    mask = bounds - 1;
+  }
+
+  /* the ring follows the header in the same block, which is aligned so that
+   * the spsc indices really sit on separate cache lines */
+  size_t size = sizeof(rpa_queue_t) +
+                (size_t)queue_capacity * n_classes * elt_size;
+  if (posix_memalign((void **)&queue, RPA_CACHE_LINE, size)) {
     return false;
   }
   *q = queue;
   memset(queue, 0, sizeof(rpa_queue_t));
+  queue->event_fd[0] = -1;
+  queue->event_fd[1] = -1;
+  queue->mask = mask;
+  queue->elt_size = (uint32_t)elt_size;
 
-  if (!(queue->one_big_mutex = malloc(sizeof(pthread_mutex_t)))) return false;
-  if (!(queue->not_empty = malloc(sizeof(pthread_cond_t)))) return false;
-  if (!(queue->not_full = malloc(sizeof(pthread_cond_t)))) return false;
-
-  pthread_mutexattr_t attr;
-  pthread_mutexattr_init(&attr);
-  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-  int rv = pthread_mutex_init(queue->one_big_mutex, &attr);
+  int rv = rpa_mutex_init(&queue->one_big_mutex);
   if (rv != 0) {
-    Q_DBG("pthread_mutex_init failed", queue);
+    Q_DBG("rpa_mutex_init failed", queue);
     goto error;
   }
 
-  rv = pthread_cond_init(queue->not_empty, NULL);
+  rv = rpa_cond_init(&queue->not_empty);
   if (rv != 0) {
-    Q_DBG("pthread_cond_init not_empty failed", queue);
+    Q_DBG("rpa_cond_init not_empty failed", queue);
     goto error;
   }
 
-  rv = pthread_cond_init(queue->not_full, NULL);
+  rv = rpa_cond_init(&queue->not_full);
   if (rv != 0) {
-    Q_DBG("pthread_cond_init not_full failed", queue);
+    Q_DBG("rpa_cond_init not_full failed", queue);
     goto error;
   }
 
-  /* Set all the data in the queue to NULL */
-  queue->data = malloc(queue_capacity * sizeof(void*));
-  queue->bounds = queue_capacity;
+  queue->bounds = queue_capacity * n_classes;
+  queue->class_bounds = queue_capacity;
+  queue->n_classes = n_classes;
+  for (uint32_t i = 0; i < n_classes; ++i) {
+    queue->classes[i].base = i * queue_capacity;
+    queue->classes[i].weight = weights ? weights[i] : 0;
+    queue->classes[i].credit = queue->classes[i].weight;
+  }
   queue->nelts = 0;
-  queue->in = 0;
-  queue->out = 0;
   queue->terminated = 0;
   queue->full_waiters = 0;
   queue->empty_waiters = 0;
+  queue->fd_waiters = 0;
+  queue->flags = flags;
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->pop_parked, 0);
+  atomic_init(&queue->push_parked, 0);
+
+#ifndef RPA_QUEUE_NO_STATS
+  if (flags & RPA_QUEUE_STATS) {
+    if (posix_memalign((void **)&queue->stats, RPA_CACHE_LINE,
+                       sizeof(struct rpa_queue_counters))) {
+      queue->stats = NULL;
+      Q_DBG("stats allocation failed", queue);
+      goto error;
+    }
+    memset(queue->stats, 0, sizeof(struct rpa_queue_counters));
+  }
+#endif
+
+  if (flags & RPA_QUEUE_POLLABLE) {
+#if defined __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+      Q_DBG("eventfd failed", queue);
+      goto error;
+    }
+    queue->event_fd[0] = fd;
+    queue->event_fd[1] = fd;
+#else
+    if (pipe(queue->event_fd) != 0) {
+      Q_DBG("pipe failed", queue);
+      goto error;
+    }
+    for (int i = 0; i < 2; ++i) {
+      fcntl(queue->event_fd[i], F_SETFL,
+            fcntl(queue->event_fd[i], F_GETFL, 0) | O_NONBLOCK);
+      fcntl(queue->event_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+  }
 
   return true;
 
@@ -128,6 +989,11 @@ error:
   return false;
 }
 
+int rpa_queue_pollfd(rpa_queue_t *queue)
+{
+  return queue->event_fd[0];
+}
+
 /**
  * Push new data onto the queue. Blocks if the queue is full. Once
  * the push operation has completed, it signals other threads waiting
@@ -135,46 +1001,61 @@ error:
  */
 bool rpa_queue_push(rpa_queue_t *queue, void *data)
 {
-  return rpa_queue_timedpush(queue, data, RPA_WAIT_FOREVER);
+  return rpa_queue_timedpush_elt(queue, &data, RPA_WAIT_FOREVER);
 }
 
 bool rpa_queue_timedpush(rpa_queue_t *queue, void *data, int wait_ms)
 {
-  bool rv;
+  return rpa_queue_timedpush_elt(queue, &data, wait_ms);
+}
+
+/**
+ * Push new data onto the queue. If the queue is full, return RPA_EAGAIN. If
+ * the push operation completes successfully, it signals other threads
+ * waiting in rpa_queue_pop() that they may continue consuming sockets.
+ */
+bool rpa_queue_trypush(rpa_queue_t *queue, void *data)
+{
+  return rpa_queue_timedpush_elt(queue, &data, RPA_WAIT_NONE);
+}
 
-  if (wait_ms == RPA_WAIT_NONE) return rpa_queue_trypush(queue, data);
+bool rpa_queue_timedpush_elt(rpa_queue_t *queue, const void *elt, int wait_ms)
+{
+  if (queue->flags & RPA_QUEUE_SPSC) {
+    if (queue->terminated) return false;
+    if (wait_ms == RPA_WAIT_NONE) return spsc_trypush_batch(queue, elt, 1);
+    return spsc_timedpush_batch(queue, elt, 1, wait_ms) == 1;
+  }
+
+  struct rpa_queue_class *c = &queue->classes[queue->n_classes - 1];
+  bool rv;
 
   if (queue->terminated) {
     return false; /* no more elements ever again */
   }
 
-  rv = pthread_mutex_lock(queue->one_big_mutex);
+  rv = rpa_queue_lock(queue);
   if (rv != 0) {
     Q_DBG("failed to lock mutex", queue);
     return false;
   }
 
-  if (rpa_queue_full(queue)) {
+  if (rpa_queue_class_full(queue, c)) {
+    if (wait_ms == RPA_WAIT_NONE) {
+      rpa_mutex_unlock(&queue->one_big_mutex);
+      return false; //EAGAIN;
+    }
     if (!queue->terminated) {
-      queue->full_waiters++;
-      if (wait_ms == RPA_WAIT_FOREVER) {
-        rv = pthread_cond_wait(queue->not_full, queue->one_big_mutex);
-      } else {
-        struct timespec abstime;
-        set_timeout(&abstime, wait_ms);
-        rv = pthread_cond_timedwait(queue->not_full, queue->one_big_mutex,
-          &abstime);
-      }
-      queue->full_waiters--;
-      if (rv != 0) {
-        pthread_mutex_unlock(queue->one_big_mutex);
+      if (!rpa_queue_wait_locked(queue, &queue->not_full, &queue->full_waiters,
+                                 wait_ms)) {
+        rpa_mutex_unlock(&queue->one_big_mutex);
         return false;
       }
     }
     /* If we wake up and it's still empty, then we were interrupted */
-    if (rpa_queue_full(queue)) {
+    if (rpa_queue_class_full(queue, c)) {
       Q_DBG("queue full (intr)", queue);
-      rv = pthread_mutex_unlock(queue->one_big_mutex);
+      rv = rpa_mutex_unlock(&queue->one_big_mutex);
       if (rv != 0) {
         return false;
       }
@@ -186,66 +1067,22 @@ bool rpa_queue_timedpush(rpa_queue_t *queue, void *data, int wait_ms)
     }
   }
 
-  queue->data[queue->in] = data;
-  queue->in++;
-  if (queue->in >= queue->bounds) {
-    queue->in -= queue->bounds;
-  }
-  queue->nelts++;
+  rpa_queue_put_locked(queue, c, elt, 1);
 
   if (queue->empty_waiters) {
     Q_DBG("sig !empty", queue);
-    rv = pthread_cond_signal(queue->not_empty);
+    rv = rpa_cond_signal(&queue->not_empty);
     if (rv != 0) {
-      pthread_mutex_unlock(queue->one_big_mutex);
+      rpa_mutex_unlock(&queue->one_big_mutex);
       return false;
     }
   }
-
-  pthread_mutex_unlock(queue->one_big_mutex);
-  return true;
-}
-
-/**
- * Push new data onto the queue. If the queue is full, return RPA_EAGAIN. If
- * the push operation completes successfully, it signals other threads
- * waiting in rpa_queue_pop() that they may continue consuming sockets.
- */
-bool rpa_queue_trypush(rpa_queue_t *queue, void *data)
-{
-  bool rv;
-
-  if (queue->terminated) {
-    return false; /* no more elements ever again */
-  }
-
-  rv = pthread_mutex_lock(queue->one_big_mutex);
-  if (rv != 0) {
-    return false;
-  }
-
-  if (rpa_queue_full(queue)) {
-    rv = pthread_mutex_unlock(queue->one_big_mutex);
-    return false; //EAGAIN;
-  }
-
-  queue->data[queue->in] = data;
-  queue->in++;
-  if (queue->in >= queue->bounds) {
-    queue->in -= queue->bounds;
-  }
-  queue->nelts++;
-
-  if (queue->empty_waiters) {
-    Q_DBG("sig !empty", queue);
-    rv = pthread_cond_signal(queue->not_empty);
-    if (rv != 0) {
-      pthread_mutex_unlock(queue->one_big_mutex);
-      return false;
-    }
+  if (queue->fd_waiters) {
+    Q_DBG("notify !empty", queue);
+    rpa_queue_notify(queue);
   }
 
-  pthread_mutex_unlock(queue->one_big_mutex);
+  rpa_mutex_unlock(&queue->one_big_mutex);
   return true;
 }
 
@@ -253,6 +1090,9 @@ bool rpa_queue_trypush(rpa_queue_t *queue, void *data)
  * not thread safe
  */
 uint32_t rpa_queue_size(rpa_queue_t *queue) {
+  if (queue->flags & RPA_QUEUE_SPSC) {
+    return spsc_size(queue);
+  }
   return queue->nelts;
 }
 
@@ -264,46 +1104,60 @@ uint32_t rpa_queue_size(rpa_queue_t *queue) {
  */
 bool rpa_queue_pop(rpa_queue_t *queue, void **data)
 {
-  return rpa_queue_timedpop(queue, data, RPA_WAIT_FOREVER);
+  return rpa_queue_timedpop_elt(queue, data, RPA_WAIT_FOREVER);
 }
 
 bool rpa_queue_timedpop(rpa_queue_t *queue, void **data, int wait_ms)
 {
-  bool rv;
+  return rpa_queue_timedpop_elt(queue, data, wait_ms);
+}
+
+/**
+ * Retrieves the next item from the queue. If there are no
+ * items available, return RPA_EAGAIN.  Once retrieved,
+ * the item is placed into the address specified by 'data'.
+ */
+bool rpa_queue_trypop(rpa_queue_t *queue, void **data)
+{
+  return rpa_queue_timedpop_elt(queue, data, RPA_WAIT_NONE);
+}
+
+bool rpa_queue_timedpop_elt(rpa_queue_t *queue, void *elt, int wait_ms)
+{
+  if (queue->flags & RPA_QUEUE_SPSC) {
+    if (queue->terminated) return false;
+    if (wait_ms == RPA_WAIT_NONE) return spsc_trypop_batch(queue, elt, 1);
+    return spsc_timedpop_batch(queue, elt, 1, wait_ms) == 1;
+  }
 
-  if (wait_ms == RPA_WAIT_NONE) return rpa_queue_trypop(queue, data);
+  bool rv;
 
   if (queue->terminated) {
     return false; /* no more elements ever again */
   }
 
-  rv = pthread_mutex_lock(queue->one_big_mutex);
+  rv = rpa_queue_lock(queue);
   if (rv != 0) {
     return false;
   }
 
   /* Keep waiting until we wake up and find that the queue is not empty. */
   if (rpa_queue_empty(queue)) {
+    if (wait_ms == RPA_WAIT_NONE) {
+      rpa_mutex_unlock(&queue->one_big_mutex);
+      return false; //EAGAIN;
+    }
     if (!queue->terminated) {
-      queue->empty_waiters++;
-      if (wait_ms == RPA_WAIT_FOREVER) {
-        rv = pthread_cond_wait(queue->not_empty, queue->one_big_mutex);
-      } else {
-        struct timespec abstime;
-        set_timeout(&abstime, wait_ms);
-        rv = pthread_cond_timedwait(queue->not_empty, queue->one_big_mutex,
-          &abstime);
-      }
-      queue->empty_waiters--;
-      if (rv != 0) {
-        pthread_mutex_unlock(queue->one_big_mutex);
+      if (!rpa_queue_wait_locked(queue, &queue->not_empty,
+                                 &queue->empty_waiters, wait_ms)) {
+        rpa_mutex_unlock(&queue->one_big_mutex);
         return false;
       }
     }
     /* If we wake up and it's still empty, then we were interrupted */
     if (rpa_queue_empty(queue)) {
       Q_DBG("queue empty (intr)", queue);
-      rv = pthread_mutex_unlock(queue->one_big_mutex);
+      rv = rpa_mutex_unlock(&queue->one_big_mutex);
       if (rv != 0) {
         return false;
       }
@@ -315,66 +1169,287 @@ bool rpa_queue_timedpop(rpa_queue_t *queue, void **data, int wait_ms)
     }
   }
 
-  *data = queue->data[queue->out];
-  queue->nelts--;
+  rpa_queue_take_locked(queue, elt, 1);
+  rpa_queue_wake_pushers(queue, 1);
+
+  rpa_mutex_unlock(&queue->one_big_mutex);
+  return true;
+}
+
+/**
+ * Retrieves the next item from a pollable queue. If there are no items
+ * available, registers as a descriptor waiter and calls 'wait' on the
+ * queue's descriptor with the lock released, so that the caller's own
+ * scheduler (e.g. libdill) decides how to block.
+ */
+bool rpa_queue_fdpop(rpa_queue_t *queue, void **data,
+                     rpa_queue_fdwait_t wait, int64_t deadline)
+{
+  return rpa_queue_fdpop_batch(queue, data, 1, wait, deadline) == 1;
+}
+
+uint32_t rpa_queue_fdpop_batch(rpa_queue_t *queue, void **out, uint32_t max,
+                               rpa_queue_fdwait_t wait, int64_t deadline)
+{
+  return rpa_queue_fdpop_elts(queue, out, max, wait, deadline);
+}
+
+uint32_t rpa_queue_fdpop_elts(rpa_queue_t *queue, void *out, uint32_t max,
+                              rpa_queue_fdwait_t wait, int64_t deadline)
+{
+  uint32_t n;
+
+  if (queue->event_fd[0] < 0 || max == 0) {
+    return 0;
+  }
 
-  queue->out++;
-  if (queue->out >= queue->bounds) {
-    queue->out -= queue->bounds;
+  if (queue->flags & RPA_QUEUE_SPSC) {
+    return spsc_fdpop_batch(queue, out, max, wait, deadline);
   }
-  if (queue->full_waiters) {
-    Q_DBG("signal !full", queue);
-    rv = pthread_cond_signal(queue->not_full);
-    if (rv != 0) {
-      pthread_mutex_unlock(queue->one_big_mutex);
-      return false;
+
+  while (1) {
+    if (queue->terminated) {
+      return 0; /* no more elements ever again */
+    }
+
+    if ((n = rpa_queue_pop_elts(queue, out, max, RPA_WAIT_NONE))) {
+      return n;
+    }
+
+    if (rpa_queue_lock(queue) != 0) {
+      return 0;
+    }
+    /* a push may have slipped in between trypop and taking the lock */
+    if (!rpa_queue_empty(queue) || queue->terminated) {
+      rpa_mutex_unlock(&queue->one_big_mutex);
+      continue;
+    }
+    queue->fd_waiters++;
+    rpa_mutex_unlock(&queue->one_big_mutex);
+
+    uint64_t since = rpa_stat_clock(queue);
+    int rv = wait(queue->event_fd[0], deadline);
+    int err = errno;
+    rpa_stat_waited(queue, false, since, rv < 0 && err == ETIMEDOUT);
+
+    rpa_queue_lock(queue);
+    /* leave the descriptor readable while anyone else still waits on it */
+    if (--queue->fd_waiters == 0) {
+      rpa_queue_drain(queue);
+    }
+    rpa_mutex_unlock(&queue->one_big_mutex);
+
+    if (rv < 0) {
+      errno = err;
+      return 0;
     }
   }
+}
 
-  pthread_mutex_unlock(queue->one_big_mutex);
-  return true;
+uint32_t rpa_queue_push_batch(rpa_queue_t *queue, void **items, uint32_t n)
+{
+  return rpa_queue_timedpush_elts(queue, items, n, RPA_WAIT_FOREVER);
+}
+
+uint32_t rpa_queue_timedpush_batch(rpa_queue_t *queue, void **items,
+                                   uint32_t n, int wait_ms)
+{
+  return rpa_queue_timedpush_elts(queue, items, n, wait_ms);
+}
+
+uint32_t rpa_queue_timedpush_elts(rpa_queue_t *queue, const void *items,
+                                  uint32_t n, int wait_ms)
+{
+  return rpa_queue_timedpush_class(queue, queue->n_classes - 1, items, n,
+                                   wait_ms);
 }
 
 /**
- * Retrieves the next item from the queue. If there are no
- * items available, return RPA_EAGAIN.  Once retrieved,
- * the item is placed into the address specified by 'data'.
+ * Push up to n items with a single lock acquisition and a single wakeup.
+ * Blocks (up to wait_ms) only while the class is completely full.
  */
-bool rpa_queue_trypop(rpa_queue_t *queue, void **data)
+uint32_t rpa_queue_timedpush_class(rpa_queue_t *queue, uint32_t cls,
+                                   const void *items, uint32_t n, int wait_ms)
 {
-  bool rv;
+  if (n == 0 || queue->terminated || cls >= queue->n_classes) {
+    return 0;
+  }
 
-  if (queue->terminated) {
-    return false; /* no more elements ever again */
+  if (queue->flags & RPA_QUEUE_SPSC) {
+    if (wait_ms == RPA_WAIT_NONE) return spsc_trypush_batch(queue, items, n);
+    return spsc_timedpush_batch(queue, items, n, wait_ms);
   }
 
-  rv = pthread_mutex_lock(queue->one_big_mutex);
-  if (rv != 0) {
-    return false;
+  if (rpa_queue_lock(queue) != 0) {
+    Q_DBG("failed to lock mutex", queue);
+    return 0;
   }
 
-  if (rpa_queue_empty(queue)) {
-    rv = pthread_mutex_unlock(queue->one_big_mutex);
-    return false; //EAGAIN;
+  struct rpa_queue_class *c = &queue->classes[cls];
+  if (rpa_queue_class_full(queue, c) && wait_ms != RPA_WAIT_NONE &&
+      !queue->terminated) {
+    rpa_queue_wait_locked(queue, &queue->not_full, &queue->full_waiters,
+                          wait_ms);
+  }
+
+  uint32_t room = queue->class_bounds - c->nelts;
+  if (n > room) n = room;
+  if (n == 0 || queue->terminated) {
+    Q_DBG("queue full (batch)", queue);
+    rpa_mutex_unlock(&queue->one_big_mutex);
+    return 0;
   }
 
-  *data = queue->data[queue->out];
-  queue->nelts--;
+  rpa_queue_put_locked(queue, c, items, n);
 
-  queue->out++;
-  if (queue->out >= queue->bounds) {
-    queue->out -= queue->bounds;
+  if (queue->empty_waiters) {
+    Q_DBG("sig !empty (batch)", queue);
+    if (n > 1) {
+      rpa_cond_broadcast(&queue->not_empty);
+    } else {
+      rpa_cond_signal(&queue->not_empty);
+    }
   }
-  if (queue->full_waiters) {
-    Q_DBG("signal !full", queue);
-    rv = pthread_cond_signal(queue->not_full);
-    if (rv != 0) {
-      pthread_mutex_unlock(queue->one_big_mutex);
-      return false;
+  if (queue->fd_waiters) {
+    rpa_queue_notify(queue);
+  }
+
+  rpa_mutex_unlock(&queue->one_big_mutex);
+  return n;
+}
+
+/**
+ * Pop up to max items with a single lock acquisition and a single wakeup.
+ * Blocks (up to wait_ms) only while the queue is empty.
+ */
+uint32_t rpa_queue_pop_batch(rpa_queue_t *queue, void **out, uint32_t max,
+                             int wait_ms)
+{
+  return rpa_queue_pop_elts(queue, out, max, wait_ms);
+}
+
+uint32_t rpa_queue_pop_elts(rpa_queue_t *queue, void *out, uint32_t max,
+                            int wait_ms)
+{
+  if (max == 0 || queue->terminated) {
+    return 0;
+  }
+
+  if (queue->flags & RPA_QUEUE_SPSC) {
+    if (wait_ms == RPA_WAIT_NONE) return spsc_trypop_batch(queue, out, max);
+    return spsc_timedpop_batch(queue, out, max, wait_ms);
+  }
+
+  if (rpa_queue_lock(queue) != 0) {
+    return 0;
+  }
+
+  if (rpa_queue_empty(queue) && wait_ms != RPA_WAIT_NONE && !queue->terminated) {
+    rpa_queue_wait_locked(queue, &queue->not_empty, &queue->empty_waiters,
+                          wait_ms);
+  }
+
+  uint32_t n = queue->nelts < max ? queue->nelts : max;
+  if (n == 0 || queue->terminated) {
+    Q_DBG("queue empty (batch)", queue);
+    rpa_mutex_unlock(&queue->one_big_mutex);
+    return 0;
+  }
+
+  rpa_queue_take_locked(queue, out, n);
+  rpa_queue_wake_pushers(queue, n);
+
+  rpa_mutex_unlock(&queue->one_big_mutex);
+  return n;
+}
+
+/**
+ * Takes up to max of the most recently pushed items, i.e. from the opposite
+ * end than the owner pops from, handing them out oldest first. Only sockets
+ * which nobody has started on yet are ever moved to another consumer.
+ * Priority classes are stolen from in order of urgency.
+ */
+uint32_t rpa_queue_steal_batch(rpa_queue_t *queue, void **out, uint32_t max)
+{
+  return rpa_queue_steal_elts(queue, out, max);
+}
+
+uint32_t rpa_queue_steal_elts(rpa_queue_t *queue, void *out, uint32_t max)
+{
+  /* a spsc ring must not have a second consumer */
+  if ((queue->flags & RPA_QUEUE_SPSC) || max == 0 || queue->terminated) {
+    return 0;
+  }
+
+  if (rpa_queue_lock(queue) != 0) {
+    return 0;
+  }
+
+  uint32_t n = queue->nelts < max ? queue->nelts : max;
+  if (n == 0) {
+    rpa_mutex_unlock(&queue->one_big_mutex);
+    return 0;
+  }
+
+  /* the thief is idle, so the most urgent classes go first */
+  struct rpa_queue_class *c = queue->classes;
+  for (uint32_t done = 0, k; done < n; done += k, ++c) {
+    k = n - done < c->nelts ? n - done : c->nelts;
+    if (k == 0) {
+      continue;
     }
+
+    uint32_t start = c->in >= k ? c->in - k : c->in + queue->class_bounds - k;
+    rpa_queue_ring_read(queue, c->base, queue->class_bounds, start,
+                        (unsigned char *)out + (size_t)done * queue->elt_size,
+                        k);
+    c->in = start;
+    c->nelts -= k;
+  }
+
+  queue->nelts -= n;
+  RPA_STAT_ADD(queue, steals, n);
+  rpa_queue_wake_pushers(queue, n);
+
+  rpa_mutex_unlock(&queue->one_big_mutex);
+  return n;
+}
+
+bool rpa_queue_trysteal(rpa_queue_t *queue, void **data)
+{
+  return rpa_queue_steal_batch(queue, data, 1) == 1;
+}
+
+/**
+ * Copies the counters out one by one, without locking the queue.
+ */
+bool rpa_queue_stats(rpa_queue_t *queue, rpa_queue_stats_t *stats)
+{
+  struct rpa_queue_counters *c = queue->stats;
+
+  if (!c) {
+    return false;
   }
 
-  pthread_mutex_unlock(queue->one_big_mutex);
+  stats->pushes = atomic_load_explicit(&c->pushes, memory_order_relaxed);
+  stats->pops = atomic_load_explicit(&c->pops, memory_order_relaxed);
+  stats->steals = atomic_load_explicit(&c->steals, memory_order_relaxed);
+  stats->push_waits = atomic_load_explicit(&c->push_waits,
+                                           memory_order_relaxed);
+  stats->pop_waits = atomic_load_explicit(&c->pop_waits, memory_order_relaxed);
+  stats->push_timeouts = atomic_load_explicit(&c->push_timeouts,
+                                              memory_order_relaxed);
+  stats->pop_timeouts = atomic_load_explicit(&c->pop_timeouts,
+                                             memory_order_relaxed);
+  stats->push_wait_ns = atomic_load_explicit(&c->push_wait_ns,
+                                             memory_order_relaxed);
+  stats->pop_wait_ns = atomic_load_explicit(&c->pop_wait_ns,
+                                            memory_order_relaxed);
+  stats->contended = atomic_load_explicit(&c->contended, memory_order_relaxed);
+  stats->high_water = atomic_load_explicit(&c->high_water,
+                                           memory_order_relaxed);
+  stats->size = rpa_queue_size(queue);
+  stats->bounds = queue->bounds;
   return true;
 }
 
@@ -382,13 +1457,16 @@ bool rpa_queue_interrupt_all(rpa_queue_t *queue)
 {
   bool rv;
   Q_DBG("intr all", queue);
-  if ((rv = pthread_mutex_lock(queue->one_big_mutex)) != 0) {
+  if ((rv = rpa_queue_lock(queue)) != 0) {
     return false;
   }
-  pthread_cond_broadcast(queue->not_empty);
-  pthread_cond_broadcast(queue->not_full);
+  rpa_cond_broadcast(&queue->not_empty);
+  rpa_cond_broadcast(&queue->not_full);
+  if (queue->fd_waiters) {
+    rpa_queue_notify(queue);
+  }
 
-  if ((rv = pthread_mutex_unlock(queue->one_big_mutex)) != 0) {
+  if ((rv = rpa_mutex_unlock(&queue->one_big_mutex)) != 0) {
     return false;
   }
 
@@ -399,7 +1477,7 @@ bool rpa_queue_term(rpa_queue_t *queue)
 {
   bool rv;
 
-  if ((rv = pthread_mutex_lock(queue->one_big_mutex)) != 0) {
+  if ((rv = rpa_queue_lock(queue)) != 0) {
     return false;
   }
 
@@ -408,7 +1486,7 @@ bool rpa_queue_term(rpa_queue_t *queue)
    * would-be popper checks it but right before they block
    */
   queue->terminated = 1;
-  if ((rv = pthread_mutex_unlock(queue->one_big_mutex)) != 0) {
+  if ((rv = rpa_mutex_unlock(&queue->one_big_mutex)) != 0) {
     return false;
   }
   return rpa_queue_interrupt_all(queue);
@@ -17,14 +17,25 @@
 #ifndef RPA_QUEUE_H
 #define RPA_QUEUE_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <pthread.h>
 
+#include "cache_line.h"
+
 #define RPA_WAIT_NONE     0
 #define RPA_WAIT_FOREVER  -1
 
+/* flags for rpa_queue_create_ex() */
+#define RPA_QUEUE_POLLABLE  0x1 /**< signal pushes through rpa_queue_pollfd() */
+#define RPA_QUEUE_SPSC      0x2 /**< lock-free single producer/consumer ring */
+#define RPA_QUEUE_STATS     0x4 /**< keep counters for rpa_queue_stats() */
+
+/* most priority classes rpa_queue_create_prio() accepts */
+#define RPA_QUEUE_MAX_CLASSES 8
+
 /**
  * @file rpa_queue.h
  * @brief Thread Safe FIFO bounded queue
@@ -39,23 +50,98 @@
  * @{
  */
 
+/**
+ * lock and condition variable of the queue: futex based when built with
+ * RPA_QUEUE_FUTEX (Linux only), pthread ones otherwise
+ */
+#ifdef RPA_QUEUE_FUTEX
+typedef struct rpa_mutex_t {
+  atomic_uint state; /**< 0 free, 1 locked, 2 locked with sleepers */
+  atomic_int spins; /**< running estimate of the spins a lock takes */
+} rpa_mutex_t;
+
+typedef struct rpa_cond_t {
+  atomic_uint seq; /**< bumped by every signal, the futex word */
+  atomic_uint waiters;
+} rpa_cond_t;
+#else
+typedef pthread_mutex_t rpa_mutex_t;
+typedef pthread_cond_t rpa_cond_t;
+#endif
+
+/**
+ * counters kept by a queue created with RPA_QUEUE_STATS, opaque
+ */
+struct rpa_queue_counters;
+
+/**
+ * snapshot of a queue's counters, see rpa_queue_stats()
+ */
+typedef struct rpa_queue_stats_t {
+  uint64_t pushes;        /**< items pushed */
+  uint64_t pops;          /**< items popped by the consumer(s) */
+  uint64_t steals;        /**< items taken by rpa_queue_steal_batch() */
+  uint64_t push_waits;    /**< times a producer blocked on a full queue */
+  uint64_t pop_waits;     /**< times a consumer blocked on an empty queue */
+  uint64_t push_timeouts; /**< producer waits which ran into their deadline */
+  uint64_t pop_timeouts;  /**< consumer waits which ran into their deadline */
+  uint64_t push_wait_ns;  /**< total time producers spent blocked */
+  uint64_t pop_wait_ns;   /**< total time consumers spent blocked */
+  uint64_t contended;     /**< lock acquisitions which found it taken */
+  uint32_t high_water;    /**< most items ever queued at once */
+  uint32_t size;          /**< items queued at the time of the snapshot */
+  uint32_t bounds;        /**< capacity of the queue */
+} rpa_queue_stats_t;
+
+/**
+ * one priority class of a queue, a ring of its own within the queue's ring
+ */
+struct rpa_queue_class {
+  uint32_t in;     /**< next empty location */
+  uint32_t out;    /**< next filled location */
+  uint32_t nelts;  /**< # elements */
+  uint32_t base;   /**< first slot of the class in the queue's ring */
+  uint32_t weight; /**< pops per weighted round, 0 for strict priority */
+  uint32_t credit; /**< pops left in the current weighted round */
+};
+
 /**
  * opaque structure
  */
 typedef struct rpa_queue_t {
-  void **data;
-  volatile uint32_t nelts; /**< # elements */
-  uint32_t in;  /**< next empty location */
-  uint32_t out;   /**< next filled location */
-  uint32_t bounds;/**< max size of queue */
+  volatile uint32_t nelts; /**< # elements, in all classes */
+  uint32_t bounds;/**< max size of queue, in all classes */
+  uint32_t class_bounds; /**< max size of each class */
+  uint32_t n_classes; /**< 1 unless created by rpa_queue_create_prio() */
+  struct rpa_queue_class classes[RPA_QUEUE_MAX_CLASSES];
+  uint32_t elt_size; /**< bytes per element, see rpa_queue_create_elt() */
   uint32_t full_waiters;
   uint32_t empty_waiters;
-  pthread_mutex_t *one_big_mutex;
-  pthread_cond_t *not_empty;
-  pthread_cond_t *not_full;
+  rpa_mutex_t one_big_mutex;
+  rpa_cond_t not_empty;
+  rpa_cond_t not_full;
   int terminated;
+  int event_fd[2]; /**< read/write ends signalled for rpa_queue_fdpop() */
+  uint32_t fd_waiters;
+  int flags; /**< RPA_QUEUE_* flags the queue was created with */
+  uint32_t mask; /**< bounds - 1, RPA_QUEUE_SPSC only */
+  atomic_uint pop_parked; /**< consumers parked on a RPA_QUEUE_SPSC queue */
+  atomic_uint push_parked; /**< producers parked on a RPA_QUEUE_SPSC queue */
+  struct rpa_queue_counters *stats; /**< RPA_QUEUE_STATS only, else NULL */
+  /* RPA_QUEUE_SPSC indices, each written by one side on its own cache line */
+  _Alignas(RPA_CACHE_LINE) atomic_uint head; /**< next filled location */
+  _Alignas(RPA_CACHE_LINE) atomic_uint tail; /**< next empty location */
+  /* the ring of bounds * elt_size bytes, allocated together with the rest
+   * of the queue */
+  _Alignas(RPA_CACHE_LINE) unsigned char data[];
 } rpa_queue_t;
 
+/**
+ * function used by rpa_queue_fdpop() to wait until a descriptor is readable,
+ * e.g. libdill's fdin()
+ */
+typedef int (*rpa_queue_fdwait_t)(int fd, int64_t deadline);
+
 /**
  * create a FIFO queue
  * @param queue The new queue
@@ -64,6 +150,78 @@ typedef struct rpa_queue_t {
  */
 bool rpa_queue_create(rpa_queue_t **queue, uint32_t queue_capacity);
 
+/**
+ * create a FIFO queue which, in addition to the condition variables, signals
+ * pushes through a pollable descriptor (an eventfd, or a pipe where eventfd
+ * is not available)
+ * @param queue The new queue
+ * @param queue_capacity maximum size of the queue
+ */
+bool rpa_queue_create_pollable(rpa_queue_t **queue, uint32_t queue_capacity);
+
+/**
+ * create a FIFO queue with the given RPA_QUEUE_* flags
+ *
+ * With RPA_QUEUE_SPSC the queue is a lock-free ring which must have at most
+ * one pushing and one popping thread at a time. Its capacity is rounded up to
+ * a power of two, so it can't exceed 2^31 (EINVAL), and blocked operations
+ * spin briefly before parking on the condition variables (or the pollable
+ * descriptor for rpa_queue_fdpop()).
+ *
+ * With RPA_QUEUE_STATS the queue counts its traffic, waits and lock
+ * contention for rpa_queue_stats(). The flag is ignored when the queue is
+ * built with RPA_QUEUE_NO_STATS defined, which compiles the counting out.
+ * @param queue The new queue
+ * @param queue_capacity maximum size of the queue
+ * @param flags RPA_QUEUE_* flags
+ */
+bool rpa_queue_create_ex(rpa_queue_t **queue, uint32_t queue_capacity,
+                         int flags);
+
+/**
+ * create a FIFO queue whose elements are elt_size byte values copied in and
+ * out of the ring, rather than pointers. All the rpa_queue_*_elt(s)()
+ * functions work on any queue; the void * ones expect elt_size to be
+ * sizeof(void *), which is what the other constructors use.
+ * See also RPA_QUEUE_DEFINE_TYPED().
+ * @param queue The new queue
+ * @param queue_capacity maximum size of the queue
+ * @param elt_size size of an element in bytes
+ * @param flags RPA_QUEUE_* flags, as for rpa_queue_create_ex()
+ */
+bool rpa_queue_create_elt(rpa_queue_t **queue, uint32_t queue_capacity,
+                          size_t elt_size, int flags);
+
+/**
+ * create a queue of n_classes priority classes, each holding up to
+ * class_capacity elements of elt_size bytes. Class 0 is the most urgent.
+ *
+ * Pops take from the classes in order of priority: strictly, i.e. only from
+ * the most urgent non-empty class, when weights is NULL, otherwise by
+ * weighted round robin, where class i gets weights[i] (at least 1) pops per
+ * round while it has elements, so that the lower classes can't starve.
+ * rpa_queue_timedpush_class() pushes to a given class, all the other push
+ * functions push to the least urgent class. RPA_QUEUE_SPSC is only
+ * supported with a single class.
+ * @param queue The new queue
+ * @param class_capacity maximum size of each class
+ * @param elt_size size of an element in bytes
+ * @param n_classes number of classes, up to RPA_QUEUE_MAX_CLASSES
+ * @param weights n_classes weights, or NULL for strict priority
+ * @param flags RPA_QUEUE_* flags, as for rpa_queue_create_ex()
+ */
+bool rpa_queue_create_prio(rpa_queue_t **queue, uint32_t class_capacity,
+                           size_t elt_size, uint32_t n_classes,
+                           const uint32_t *weights, int flags);
+
+/**
+ * returns the descriptor that becomes readable when a pollable queue
+ * has been pushed to, or -1 if the queue isn't pollable.
+ *
+ * @param queue the queue
+ */
+int rpa_queue_pollfd(rpa_queue_t *queue);
+
 /**
  * push/add an object to the queue, blocking if the queue is already full
  *
@@ -110,6 +268,76 @@ bool rpa_queue_pop(rpa_queue_t *queue, void **data);
  */
 bool rpa_queue_timedpop(rpa_queue_t *queue, void **data, int wait_ms);
 
+/**
+ * pop/get an object from a pollable queue, waiting for it to become non-empty
+ * with the supplied function instead of blocking the thread on a condition
+ * variable. Passing libdill's fdin() lets other coroutines on the calling
+ * thread keep running while it waits.
+ *
+ * @param queue         the queue
+ * @param data          the data
+ * @param wait          function waiting for the queue's descriptor
+ * @param deadline      deadline passed through to wait
+ * @returns RPA_EOF     if the queue has been terminated or isn't pollable
+ * @returns RPA_ETIMEDOUT/ECANCELED as reported by wait (errno is preserved)
+ * @returns RPA_SUCCESS on a successful pop
+ */
+bool rpa_queue_fdpop(rpa_queue_t *queue, void **data,
+                     rpa_queue_fdwait_t wait, int64_t deadline);
+
+/**
+ * pop/get up to max objects from a pollable queue, waiting like
+ * rpa_queue_fdpop() while the queue is empty
+ *
+ * @param queue         the queue
+ * @param out           array receiving the objects
+ * @param max           size of out
+ * @param wait          function waiting for the queue's descriptor
+ * @param deadline      deadline passed through to wait
+ * @returns the number of objects popped, 0 on termination or wait failure
+ */
+uint32_t rpa_queue_fdpop_batch(rpa_queue_t *queue, void **out, uint32_t max,
+                               rpa_queue_fdwait_t wait, int64_t deadline);
+
+/**
+ * push/add up to n objects to the queue under a single lock acquisition,
+ * blocking while the queue is completely full
+ *
+ * @param queue the queue
+ * @param items the objects
+ * @param n number of objects in items
+ * @returns the number of objects pushed (the leading part of items), 0 if the
+ * queue has been terminated or the wait was interrupted
+ */
+uint32_t rpa_queue_push_batch(rpa_queue_t *queue, void **items, uint32_t n);
+
+/**
+ * push/add up to n objects to the queue under a single lock acquisition,
+ * blocking up to wait_ms while the queue is completely full
+ *
+ * @param queue         the queue
+ * @param items         the objects
+ * @param n             number of objects in items
+ * @param wait_ms       milliseconds to wait, RPA_WAIT_NONE or RPA_WAIT_FOREVER
+ * @returns the number of objects pushed (the leading part of items)
+ */
+uint32_t rpa_queue_timedpush_batch(rpa_queue_t *queue, void **items,
+                                   uint32_t n, int wait_ms);
+
+/**
+ * pop/get up to max objects from the queue under a single lock acquisition,
+ * blocking up to wait_ms while the queue is empty
+ *
+ * @param queue         the queue
+ * @param out           array receiving the objects
+ * @param max           size of out
+ * @param wait_ms       milliseconds to wait, RPA_WAIT_NONE or RPA_WAIT_FOREVER
+ * @returns the number of objects popped, 0 on timeout, interruption or
+ * termination
+ */
+uint32_t rpa_queue_pop_batch(rpa_queue_t *queue, void **out, uint32_t max,
+                             int wait_ms);
+
 /**
  * push/add an object to the queue, returning immediately if the queue is full
  *
@@ -134,6 +362,152 @@ bool rpa_queue_trypush(rpa_queue_t *queue, void *data);
  */
 bool rpa_queue_trypop(rpa_queue_t *queue, void **data);
 
+/**
+ * steal an object from another consumer's queue: takes the most recently
+ * pushed object, returning immediately if the queue is empty. Not supported
+ * by RPA_QUEUE_SPSC queues, which must only have a single consumer.
+ *
+ * @param queue the queue
+ * @param data the data
+ * @returns RPA_EAGAIN the queue is empty or single consumer only
+ * @returns RPA_EOF the queue has been terminated
+ * @returns RPA_SUCCESS on a successful steal
+ */
+bool rpa_queue_trysteal(rpa_queue_t *queue, void **data);
+
+/**
+ * steal up to max of the most recently pushed objects from another
+ * consumer's queue under a single lock acquisition, without blocking. The
+ * objects are stored in out in the order they were pushed, class by class
+ * starting with the most urgent one for a queue with priority classes.
+ *
+ * @param queue the queue
+ * @param out array receiving the objects
+ * @param max size of out
+ * @returns the number of objects stolen
+ */
+uint32_t rpa_queue_steal_batch(rpa_queue_t *queue, void **out, uint32_t max);
+
+/**
+ * push/add a copy of the element at elt, waiting up to wait_ms while the
+ * queue is full
+ *
+ * @param queue         the queue
+ * @param elt           the element, elt_size bytes
+ * @param wait_ms       milliseconds to wait, RPA_WAIT_NONE or RPA_WAIT_FOREVER
+ * @returns false if the queue is full, has been terminated or the wait was
+ * interrupted
+ */
+bool rpa_queue_timedpush_elt(rpa_queue_t *queue, const void *elt, int wait_ms);
+
+/**
+ * pop/get the next element into elt, waiting up to wait_ms while the queue
+ * is empty
+ *
+ * @param queue         the queue
+ * @param elt           receives the element, elt_size bytes
+ * @param wait_ms       milliseconds to wait, RPA_WAIT_NONE or RPA_WAIT_FOREVER
+ * @returns false if the queue is empty, has been terminated or the wait was
+ * interrupted
+ */
+bool rpa_queue_timedpop_elt(rpa_queue_t *queue, void *elt, int wait_ms);
+
+/**
+ * rpa_queue_timedpush_batch() for the n elements stored back to back at elts
+ */
+uint32_t rpa_queue_timedpush_elts(rpa_queue_t *queue, const void *elts,
+                                  uint32_t n, int wait_ms);
+
+/**
+ * rpa_queue_timedpush_elts() to the given priority class
+ *
+ * @param queue         the queue
+ * @param cls           the class, 0 is the most urgent
+ * @param elts          the elements, elt_size bytes each
+ * @param n             number of elements
+ * @param wait_ms       milliseconds to wait, RPA_WAIT_NONE or RPA_WAIT_FOREVER
+ * @returns the number of elements pushed, 0 as well for a class the queue
+ * doesn't have
+ */
+uint32_t rpa_queue_timedpush_class(rpa_queue_t *queue, uint32_t cls,
+                                   const void *elts, uint32_t n, int wait_ms);
+
+/**
+ * rpa_queue_pop_batch() into an array of max elements at out
+ */
+uint32_t rpa_queue_pop_elts(rpa_queue_t *queue, void *out, uint32_t max,
+                            int wait_ms);
+
+/**
+ * rpa_queue_fdpop_batch() into an array of max elements at out
+ */
+uint32_t rpa_queue_fdpop_elts(rpa_queue_t *queue, void *out, uint32_t max,
+                              rpa_queue_fdwait_t wait, int64_t deadline);
+
+/**
+ * rpa_queue_steal_batch() into an array of max elements at out
+ */
+uint32_t rpa_queue_steal_elts(rpa_queue_t *queue, void *out, uint32_t max);
+
+/**
+ * Declares type checked wrappers around the element API for a queue of
+ * 'type' values: name_queue_create(), name_queue_create_prio(),
+ * name_queue_push(), name_queue_pop(), name_queue_push_batch(),
+ * name_queue_push_class(), name_queue_pop_batch(), name_queue_fdpop_batch()
+ * and name_queue_steal_batch(). The queue itself is a plain rpa_queue_t, so
+ * rpa_queue_term(), rpa_queue_size(), rpa_queue_stats() etc. apply as is.
+ */
+#define RPA_QUEUE_DEFINE_TYPED(name, type)                                    \
+  static inline bool name##_queue_create(rpa_queue_t **queue,                 \
+                                         uint32_t capacity, int flags)        \
+  {                                                                           \
+    return rpa_queue_create_elt(queue, capacity, sizeof(type), flags);        \
+  }                                                                           \
+  static inline bool name##_queue_create_prio(                                \
+      rpa_queue_t **queue, uint32_t class_capacity, uint32_t n_classes,       \
+      const uint32_t *weights, int flags)                                     \
+  {                                                                           \
+    return rpa_queue_create_prio(queue, class_capacity, sizeof(type),         \
+                                 n_classes, weights, flags);                  \
+  }                                                                           \
+  static inline bool name##_queue_push(rpa_queue_t *queue, const type *elt,   \
+                                       int wait_ms)                           \
+  {                                                                           \
+    return rpa_queue_timedpush_elt(queue, elt, wait_ms);                      \
+  }                                                                           \
+  static inline bool name##_queue_pop(rpa_queue_t *queue, type *elt,          \
+                                      int wait_ms)                            \
+  {                                                                           \
+    return rpa_queue_timedpop_elt(queue, elt, wait_ms);                       \
+  }                                                                           \
+  static inline uint32_t name##_queue_push_batch(                             \
+      rpa_queue_t *queue, const type *elts, uint32_t n, int wait_ms)          \
+  {                                                                           \
+    return rpa_queue_timedpush_elts(queue, elts, n, wait_ms);                 \
+  }                                                                           \
+  static inline uint32_t name##_queue_push_class(                             \
+      rpa_queue_t *queue, uint32_t cls, const type *elts, uint32_t n,         \
+      int wait_ms)                                                            \
+  {                                                                           \
+    return rpa_queue_timedpush_class(queue, cls, elts, n, wait_ms);           \
+  }                                                                           \
+  static inline uint32_t name##_queue_pop_batch(                              \
+      rpa_queue_t *queue, type *out, uint32_t max, int wait_ms)               \
+  {                                                                           \
+    return rpa_queue_pop_elts(queue, out, max, wait_ms);                      \
+  }                                                                           \
+  static inline uint32_t name##_queue_fdpop_batch(                            \
+      rpa_queue_t *queue, type *out, uint32_t max, rpa_queue_fdwait_t wait,   \
+      int64_t deadline)                                                       \
+  {                                                                           \
+    return rpa_queue_fdpop_elts(queue, out, max, wait, deadline);             \
+  }                                                                           \
+  static inline uint32_t name##_queue_steal_batch(rpa_queue_t *queue,         \
+                                                  type *out, uint32_t max)    \
+  {                                                                           \
+    return rpa_queue_steal_elts(queue, out, max);                             \
+  }
+
 /**
  * returns the size of the queue.
  *
@@ -144,6 +518,17 @@ bool rpa_queue_trypop(rpa_queue_t *queue, void **data);
  */
 uint32_t rpa_queue_size(rpa_queue_t *queue);
 
+/**
+ * take a snapshot of the counters of a queue created with RPA_QUEUE_STATS.
+ * Safe to call from any thread at any time; the counters are read one by
+ * one, so a snapshot taken under load may be slightly inconsistent.
+ *
+ * @param queue the queue
+ * @param stats receives the snapshot
+ * @returns false if the queue doesn't keep stats
+ */
+bool rpa_queue_stats(rpa_queue_t *queue, rpa_queue_stats_t *stats);
+
 /**
  * interrupt all the threads blocking on this queue.
  *
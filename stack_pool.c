@@ -0,0 +1,66 @@
+#include "stack_pool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined MAP_ANONYMOUS && defined MAP_ANON
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+int stack_pool_init(struct stack_pool *pool, size_t size, size_t max) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  pool->size = (size + page - 1) / page * page;
+  pool->guard = page;
+  pool->max = max;
+  pool->mapped = 0;
+  pool->n_free = 0;
+  pool->free = malloc(max * sizeof(*pool->free));
+  if (!pool->free) return -1;
+
+  return 0;
+}
+
+void stack_pool_destroy(struct stack_pool *pool) {
+  while (pool->n_free) {
+    char *stack = pool->free[--pool->n_free];
+    munmap(stack - pool->guard, pool->guard + pool->size);
+  }
+  free(pool->free);
+  pool->free = NULL;
+  pool->mapped = 0;
+}
+
+void *stack_pool_get(struct stack_pool *pool) {
+  if (pool->n_free) return pool->free[--pool->n_free];
+  if (pool->mapped == pool->max) {
+    errno = EAGAIN;
+    return NULL;
+  }
+
+  char *map = mmap(NULL, pool->guard + pool->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (map == MAP_FAILED) return NULL;
+
+  // stacks grow down, into the guard
+  if (mprotect(map, pool->guard, PROT_NONE) < 0) {
+    int err = errno;
+    munmap(map, pool->guard + pool->size);
+    errno = err;
+    return NULL;
+  }
+
+  pool->mapped++;
+  return map + pool->guard;
+}
+
+void stack_pool_put(struct stack_pool *pool, void *stack) {
+  // never full, there are no more stacks than room for them
+  pool->free[pool->n_free++] = stack;
+}
@@ -0,0 +1,36 @@
+#ifndef STACK_POOL_H
+#define STACK_POOL_H
+
+#include <stddef.h>
+
+// Coroutine stacks of one size for libdill's go_mem(), at most max of them.
+// Every stack is mapped on its own with an inaccessible guard page below it,
+// so that an overflow faults instead of overwriting the neighbouring stack.
+// Stacks are mapped on demand and kept once they're put. A pool belongs to
+// one thread and does no locking.
+struct stack_pool {
+  // usable bytes of a stack, a multiple of the page size
+  size_t size;
+  size_t guard;
+  size_t max;
+  // stacks mapped so far, handed out or not
+  size_t mapped;
+  size_t n_free;
+  void **free;
+};
+
+// size is rounded up to whole pages, returns -1 if out of memory
+int stack_pool_init(struct stack_pool *pool, size_t size, size_t max);
+
+// unmaps every stack, none may be in use
+void stack_pool_destroy(struct stack_pool *pool);
+
+// Returns the lowest address of a stack of pool->size bytes, NULL with errno
+// set to EAGAIN if all max are handed out or ENOMEM if out of memory.
+void *stack_pool_get(struct stack_pool *pool);
+
+// Gives a stack back to the pool, once the coroutine which ran on it has
+// been closed with hclose(): libdill is done with the memory only then.
+void stack_pool_put(struct stack_pool *pool, void *stack);
+
+#endif
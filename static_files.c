@@ -0,0 +1,443 @@
+#if defined __linux__
+// for timegm() and strptime()
+#define _GNU_SOURCE
+#endif
+
+#include "static_files.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libdill.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#if defined SYS_openat2 && __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#define HAVE_OPENAT2 1
+#endif
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+
+struct static_cache {
+  int root_fd;
+  size_t n_slots;
+  struct static_file *slots[];
+};
+
+static const struct {
+  const char *ext;
+  const char *type;
+} content_types[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"ico", "image/x-icon"},
+    {"webp", "image/webp"},
+    {"woff2", "font/woff2"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+};
+
+static const char *content_type(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (dot && !strchr(dot, '/')) {
+    for (size_t i = 0; i < sizeof(content_types) / sizeof(*content_types);
+         ++i) {
+      if (!strcasecmp(dot + 1, content_types[i].ext))
+        return content_types[i].type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+// FNV-1a
+static uint64_t hash(const char *str) {
+  uint64_t h = 14695981039346656037ull;
+  for (; *str; ++str) h = (h ^ (unsigned char)*str) * 1099511628211ull;
+  return h;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') return (c | 0x20) - 'a' + 10;
+  return -1;
+}
+
+// Percent-decodes a segment of len bytes into out, returns the decoded
+// length or -1 if an escape is malformed or decodes to a slash or NUL, which
+// would change how the path splits or ends.
+static long decode_segment(const char *seg, size_t len, char *out) {
+  size_t n = 0;
+  for (size_t i = 0; i < len; ++i) {
+    char c = seg[i];
+    if (c == '%') {
+      if (i + 2 >= len) return -1;
+      int hi = hex_digit(seg[i + 1]), lo = hex_digit(seg[i + 2]);
+      if (hi < 0 || lo < 0) return -1;
+      c = (char)(hi << 4 | lo);
+      if (c == '/') return -1;
+      i += 2;
+    }
+    if (c == '\0') return -1;
+    out[n++] = c;
+  }
+  return (long)n;
+}
+
+// Turns a request target into a path relative to the root, percent-decoded
+// and without its query, empty or "." segments, with directories mapped to
+// their index. Rejects ".." segments, so that the path itself never leaves
+// the root; open_beneath() keeps symlinks from leaving it either.
+static int resolve(struct http_slice target, char *path, size_t size) {
+  const char *p = target.ptr;
+  const char *end = memchr(p, '?', target.len);
+  if (!end) end = p + target.len;
+  if (p == end || *p != '/') return -1;
+
+  size_t n = 0;
+  while (p < end) {
+    // the segment after the slash at p
+    const char *seg = p + 1;
+    const char *next = memchr(seg, '/', (size_t)(end - seg));
+    if (!next) next = end;
+    size_t len = (size_t)(next - seg);
+
+    // decoding only ever shortens a segment
+    if (n + len + 2 > size) return -1;
+    size_t start = n ? n + 1 : 0;
+    long dec = decode_segment(seg, len, path + start);
+    if (dec < 0) return -1;
+
+    const char *d = path + start;
+    if (dec == 2 && d[0] == '.' && d[1] == '.') return -1;
+    if (dec && !(dec == 1 && d[0] == '.')) {
+      if (n) path[n] = '/';
+      n = start + (size_t)dec;
+    }
+    p = next;
+  }
+
+  if (n == 0 || end[-1] == '/') {
+    static const char index[] = "index.html";
+    if (n + sizeof(index) + 1 > size) return -1;
+    if (n) path[n++] = '/';
+    memcpy(path + n, index, sizeof(index) - 1);
+    n += sizeof(index) - 1;
+  }
+
+  path[n] = '\0';
+  return 0;
+}
+
+#define OPEN_FLAGS (O_RDONLY | O_CLOEXEC | O_NOCTTY)
+
+// opens path one component at a time without following any symlink
+static int open_nofollow(int root_fd, const char *path) {
+  int dir = root_fd;
+  while (1) {
+    const char *slash = strchr(path, '/');
+    if (!slash) break;
+
+    char name[NAME_MAX + 1];
+    size_t len = (size_t)(slash - path);
+    if (len > NAME_MAX) {
+      errno = ENAMETOOLONG;
+      goto fail;
+    }
+    memcpy(name, path, len);
+    name[len] = '\0';
+
+    int fd = openat(dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) goto fail;
+    if (dir != root_fd) close(dir);
+    dir = fd;
+    path = slash + 1;
+  }
+
+  int fd = openat(dir, path, OPEN_FLAGS | O_NOFOLLOW);
+  if (dir != root_fd) {
+    int err = errno;
+    close(dir);
+    errno = err;
+  }
+  return fd;
+
+fail:;
+  int err = errno;
+  if (dir != root_fd) close(dir);
+  errno = err;
+  return -1;
+}
+
+// Opens path under root_fd without leaving the root. With openat2() symlinks
+// may point anywhere beneath the root but not out of it, otherwise none are
+// followed. An escape fails like a missing file.
+static int open_beneath(int root_fd, const char *path) {
+#ifdef HAVE_OPENAT2
+  struct open_how how = {
+      .flags = OPEN_FLAGS,
+      .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+  };
+  int fd = (int)syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+  if (fd >= 0) return fd;
+  if (errno == EXDEV) errno = ENOENT;
+  // older kernels, and seccomp filters that don't know the call yet
+  if (errno != ENOSYS && errno != EPERM) return -1;
+#endif
+  return open_nofollow(root_fd, path);
+}
+
+// reads len bytes from the start of fd, -1 if it has fewer
+static int read_all(int fd, char *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, (off_t)done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    done += (size_t)n;
+  }
+  return 0;
+}
+
+static struct static_file *open_file(int root_fd, const char *path) {
+  int fd = open_beneath(root_fd, path);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) goto fail;
+  if (!S_ISREG(st.st_mode)) {
+    errno = ENOENT;
+    goto fail;
+  }
+
+  // Small files are read into memory with the entry and served without a
+  // descriptor. A copy rather than a mapping: truncating a mapped file in
+  // place would fault whoever is sending it.
+  bool inline_data = st.st_size > 0 && st.st_size <= (off_t)STATIC_INLINE_MAX;
+  size_t len = strlen(path);
+  struct static_file *file = malloc(sizeof(*file) + len + 1 +
+                                    (inline_data ? (size_t)st.st_size : 0));
+  if (!file) goto fail;
+
+  file->data = NULL;
+  file->size = st.st_size;
+  file->mtime = st.st_mtime;
+  file->content_type = content_type(path);
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+  file->checked_ms = now();
+  file->refs = 1;
+  memcpy(file->path, path, len + 1);
+
+  struct tm tm;
+  gmtime_r(&file->mtime, &tm);
+  strftime(file->last_modified, sizeof(file->last_modified), HTTP_DATE_FORMAT,
+           &tm);
+
+  // a file that changes while it's read is sent off the descriptor instead,
+  // and revalidation picks up the new version
+  if (inline_data &&
+      read_all(fd, file->path + len + 1, (size_t)st.st_size) == 0) {
+    file->data = file->path + len + 1;
+    close(fd);
+    fd = -1;
+  }
+  file->fd = fd;
+
+  return file;
+
+fail:;
+  int err = errno;
+  close(fd);
+  errno = err;
+  return NULL;
+}
+
+struct static_cache *static_cache_create(int root_fd, size_t slots) {
+  struct static_cache *cache =
+      calloc(1, sizeof(*cache) + slots * sizeof(cache->slots[0]));
+  if (!cache) return NULL;
+
+  cache->root_fd = root_fd;
+  cache->n_slots = slots;
+  return cache;
+}
+
+void static_cache_destroy(struct static_cache *cache) {
+  if (!cache) return;
+
+  for (size_t i = 0; i < cache->n_slots; ++i)
+    if (cache->slots[i]) static_file_put(cache->slots[i]);
+  free(cache);
+}
+
+// whether a cached file is still what's on disk, checked once in a while
+static bool is_fresh(struct static_cache *cache, struct static_file *file) {
+  int64_t t = now();
+  if (t - file->checked_ms < STATIC_REVALIDATE_MS) return true;
+
+  struct stat st;
+  if (fstatat(cache->root_fd, file->path, &st, 0) < 0 ||
+      st.st_dev != file->dev || st.st_ino != file->ino ||
+      st.st_size != file->size || st.st_mtime != file->mtime)
+    return false;
+
+  file->checked_ms = t;
+  return true;
+}
+
+struct static_file *static_cache_get(struct static_cache *cache,
+                                     struct http_slice target) {
+  char path[PATH_MAX];
+  if (resolve(target, path, sizeof(path)) < 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  struct static_file **slot = &cache->slots[hash(path) % cache->n_slots];
+  struct static_file *cached = *slot;
+  bool hit = cached && !strcmp(cached->path, path);
+  if (hit && is_fresh(cache, cached)) {
+    cached->refs++;
+    return cached;
+  }
+
+  // a miss, a stale entry or another file in the slot, which gives way
+  struct static_file *file = open_file(cache->root_fd, path);
+  if (!file && !hit) return NULL;
+
+  int err = errno;
+  if (cached) static_file_put(cached);
+  *slot = file;
+  if (file) file->refs++;
+  errno = err;
+  return file;
+}
+
+void static_file_put(struct static_file *file) {
+  if (--file->refs) return;
+
+  if (file->fd >= 0) close(file->fd);
+  free(file);
+}
+
+// parses the digits at *p into *n, returns -1 if they overflow
+static int parse_offset(const char **p, const char *end, off_t *n) {
+  const char *start = *p;
+  uint64_t v = 0;
+  for (; *p < end && **p >= '0' && **p <= '9'; ++*p) {
+    v = v * 10 + (unsigned)(**p - '0');
+    if (v > (uint64_t)INT64_MAX / 10) return -1;
+  }
+  *n = (off_t)v;
+  return *p > start;
+}
+
+int static_parse_range(struct http_slice value, off_t size, off_t *offset,
+                       off_t *len) {
+  if (value.len < 6 || strncasecmp(value.ptr, "bytes=", 6) != 0) return 0;
+  const char *p = value.ptr + 6;
+  const char *end = value.ptr + value.len;
+  if (memchr(p, ',', (size_t)(end - p))) return 0;
+
+  off_t first, last;
+  int has_first = parse_offset(&p, end, &first);
+  if (has_first < 0 || p == end || *p++ != '-') return 0;
+  int has_last = parse_offset(&p, end, &last);
+  if (has_last < 0 || p != end) return 0;
+
+  if (!has_first) {
+    // the last bytes of the file
+    if (!has_last) return 0;
+    if (last == 0 || size == 0) return -1;
+    if (last > size) last = size;
+    *offset = size - last;
+    *len = last;
+    return 1;
+  }
+
+  if (has_last && last < first) return 0;
+  if (first >= size) return -1;
+  if (!has_last || last >= size) last = size - 1;
+  *offset = first;
+  *len = last - first + 1;
+  return 1;
+}
+
+bool static_not_modified(struct http_slice value, time_t mtime) {
+  char date[64];
+  if (value.len >= sizeof(date)) return false;
+  memcpy(date, value.ptr, value.len);
+  date[value.len] = '\0';
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(date, HTTP_DATE_FORMAT, &tm);
+  if (!end || *end) return false;
+
+  return mtime <= timegm(&tm);
+}
+
+// sends some of len bytes of the file from *offset on, advancing it
+static ssize_t send_some(int s, const struct static_file *file, off_t *offset,
+                         size_t len) {
+  ssize_t n;
+  if (file->data) {
+    n = send(s, file->data + *offset, len, MSG_NOSIGNAL);
+  } else {
+#if defined __linux__
+    return sendfile(s, file->fd, offset, len);
+#else
+    // the BSDs' sendfile() differs, go through a buffer instead
+    char buf[16384];
+    n = pread(file->fd, buf, len < sizeof(buf) ? len : sizeof(buf), *offset);
+    if (n <= 0) return n;
+    n = send(s, buf, (size_t)n, MSG_NOSIGNAL);
+#endif
+  }
+  if (n > 0) *offset += n;
+  return n;
+}
+
+int static_file_send(int s, const struct static_file *file, off_t offset,
+                     off_t len, int64_t deadline) {
+  while (len > 0) {
+    ssize_t n = send_some(s, file, &offset, (size_t)len);
+    if (n > 0) {
+      len -= n;
+      continue;
+    }
+    // the file shrank underneath us
+    if (n == 0) {
+      errno = EIO;
+      return -1;
+    }
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (fdout(s, deadline) < 0) return -1;
+  }
+
+  return 0;
+}
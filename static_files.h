@@ -0,0 +1,74 @@
+#ifndef STATIC_FILES_H
+#define STATIC_FILES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "http_parse.h"
+
+// files up to this size are read into memory and sent from there instead of
+// with sendfile()
+#define STATIC_INLINE_MAX (64u << 10)
+
+// how long a cached file is trusted before it is stat()ed again
+#define STATIC_REVALIDATE_MS 1000
+
+// An open file under the root, shared between the requests for it through a
+// reference count. Everything but refs is read-only once it's cached.
+struct static_file {
+  // -1 if the file is in memory, which needs no descriptor
+  int fd;
+  // a copy of the whole file if it's small enough, NULL otherwise
+  const char *data;
+  off_t size;
+  time_t mtime;
+  // mtime as an HTTP date, for Last-Modified
+  char last_modified[32];
+  const char *content_type;
+  // the cache's identity check
+  dev_t dev;
+  ino_t ino;
+  int64_t checked_ms;
+  unsigned refs;
+  // relative to the root, NUL terminated
+  char path[];
+};
+
+struct static_cache;
+
+// A cache of the files under the directory root_fd in a direct-mapped table
+// of slots entries, which bounds the descriptors it keeps open. A cache
+// belongs to one thread and does no locking.
+struct static_cache *static_cache_create(int root_fd, size_t slots);
+
+// drops the cache's references, files still handed out stay valid
+void static_cache_destroy(struct static_cache *cache);
+
+// Returns a reference to the regular file a request target names, from the
+// cache unless it changed on disk. NULL with errno set to ENOENT if there's
+// no such file (or the target is malformed or escapes the root), EACCES if
+// it can't be read or whatever open() reported.
+struct static_file *static_cache_get(struct static_cache *cache,
+                                     struct http_slice target);
+
+void static_file_put(struct static_file *file);
+
+// Parses a Range value against a file of size bytes. Returns 1 and the part
+// to send in *offset and *len for a single satisfiable range, -1 if the range
+// can't be satisfied (a 416) and 0 if the field is to be ignored, which
+// includes requests for multiple ranges.
+int static_parse_range(struct http_slice value, off_t size, off_t *offset,
+                       off_t *len);
+
+// whether an If-Modified-Since value allows a 304 for a file of that mtime
+bool static_not_modified(struct http_slice value, time_t mtime);
+
+// Sends len bytes of the file starting at offset to the non-blocking socket
+// s, waiting in libdill while it's full. Returns 0 or -1 with errno set.
+int static_file_send(int s, const struct static_file *file, off_t offset,
+                     off_t len, int64_t deadline);
+
+#endif
@@ -0,0 +1,145 @@
+// End-to-end check of connection persistence by protocol version: starts
+// the server given as the first argument, then expects an HTTP/1.0 request
+// to be answered and the connection closed, while HTTP/1.0 with
+// "Connection: keep-alive" and plain HTTP/1.1 leave it open. Exits non-zero
+// on the first failure.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT "18234"
+// the server's --keepalive, so that an open connection is told apart from
+// one closed after the response long before the server gives up on it
+#define KEEPALIVE_MS "10000"
+#define READ_TIMEOUT_S 2
+#define START_TIMEOUT_MS 5000
+
+static int port;
+
+static int connect_server(void) {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0) return -1;
+
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons((uint16_t)port)};
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(s);
+    return -1;
+  }
+
+  struct timeval tv = {READ_TIMEOUT_S, 0};
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  return s;
+}
+
+// waits for the freshly started server to listen
+static bool wait_for_server(void) {
+  for (int waited = 0; waited < START_TIMEOUT_MS; waited += 50) {
+    int s = connect_server();
+    if (s >= 0) {
+      close(s);
+      return true;
+    }
+    struct timespec pause = {0, 50 * 1000000L};
+    nanosleep(&pause, NULL);
+  }
+  return false;
+}
+
+// Sends req and reads the response. Returns 1 if the server closed the
+// connection after it, 0 if the connection is still open once the response
+// is in and -1 if there's no complete 200 response.
+static int exchange(int s, const char *req) {
+  size_t len = strlen(req);
+  if (send(s, req, len, MSG_NOSIGNAL) != (ssize_t)len) return -1;
+
+  char buf[65536];
+  size_t n = 0;
+  while (n < sizeof(buf) - 1) {
+    ssize_t rc = recv(s, buf + n, sizeof(buf) - 1 - n, 0);
+    if (rc == 0) break;
+    if (rc < 0) {
+      // the read timed out on a connection which stayed open
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+      break;
+    }
+    n += (size_t)rc;
+    buf[n] = '\0';
+
+    // a complete response on a connection left open
+    char *end = strstr(buf, "\r\n\r\n");
+    const char *cl = strstr(buf, "Content-Length: ");
+    if (end && cl && strstr(buf, "Connection: keep-alive") &&
+        n >= (size_t)(end + 4 - buf) + strtoul(cl + 16, NULL, 10))
+      return strncmp(buf, "HTTP/1.1 200 ", 13) ? -1 : 0;
+  }
+  buf[n] = '\0';
+
+  if (strncmp(buf, "HTTP/1.1 200 ", 13)) return -1;
+  return strstr(buf, "Connection: close") ? 1 : -1;
+}
+
+static bool check(const char *name, const char *req, int expected) {
+  int s = connect_server();
+  if (s < 0) {
+    perror("Can't connect");
+    return false;
+  }
+
+  int rc = exchange(s, req);
+  // an open connection must still take a request
+  if (rc == 0 && expected == 0)
+    rc = exchange(s, "GET / HTTP/1.1\r\nHost: test\r\n\r\n");
+  close(s);
+
+  bool ok = rc == expected;
+  printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s SERVER [PORT]\n", argv[0]);
+    return 2;
+  }
+  const char *port_arg = argc > 2 ? argv[2] : DEFAULT_PORT;
+  port = atoi(port_arg);
+
+  pid_t server = fork();
+  if (server < 0) {
+    perror("Can't fork");
+    return 1;
+  }
+  if (!server) {
+    execl(argv[1], argv[1], "-p", port_arg, "-t", "1", "-k", KEEPALIVE_MS,
+          "-l", "error", (char *)NULL);
+    perror("Can't start the server");
+    _exit(127);
+  }
+
+  bool ok = wait_for_server();
+  if (!ok) fprintf(stderr, "The server didn't start listening\n");
+
+  ok = ok && check("HTTP/1.0 closes", "GET / HTTP/1.0\r\n\r\n", 1);
+  ok = ok && check("HTTP/1.0 keep-alive persists",
+                   "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n", 0);
+  ok = ok && check("HTTP/1.1 persists", "GET / HTTP/1.1\r\nHost: test\r\n\r\n",
+                   0);
+
+  kill(server, SIGINT);
+  waitpid(server, NULL, 0);
+
+  return ok ? 0 : 1;
+}